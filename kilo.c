@@ -13,6 +13,17 @@
 #include <sys/types.h>
 
 #ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <termios.h>
 #include <unistd.h>
 #endif
@@ -24,14 +35,43 @@
 #include <string.h>
 #include <time.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <limits.h>
 #include <fcntl.h>
 
 /*** defines ***/
 #define KILO_VERSION "0.0.1"
 #define KILO_TAB_STOP 8
 #define KILO_QUIT_TIMES 3
+#define KILO_UNDO_LIMIT (4 * 1024 * 1024)
+#define KILO_ARENA_BLOCK (1024 * 1024)
+#define KILO_CHUNK_SIZE 4096
+#define KILO_TRACE_EVENTS (64 * 1024)
+#define KILO_FPS 120
+/* milliseconds to wait for the rest of a sequence after ESC */
+#define KILO_ESC_TIMEOUT 25
+#define KILO_INPUT_BUFFER 4096
+/* keys decoded but not yet handled, a power of two */
+#define KILO_KEY_RING 1024
+#define KILO_LONG_ROW (4 * KILO_CHUNK_SIZE)
+/* rows between samples of the line offset index */
+#define KILO_LINE_INDEX_STEP 4096
+/* most rows the pager keeps in memory, and rows kept around the cursor */
+#define KILO_PAGER_ROWS 8192
+#define KILO_PAGER_MARGIN 1024
+/* bytes read from the file at a time, and kept of a longer row */
+#define KILO_PAGER_BLOCK (1024 * 1024)
+/* bytes of standard input read ahead of the editor */
+#define KILO_STREAM_BUFFER (1024 * 1024)
+/* bytes of rows written at a time when saving */
+#define KILO_SAVE_BLOCK (64 * 1024)
 
 #define CTRL_KEY(k) ((k) & 0x1f)
+/* modifiers reported with a key */
+#define KEY_SHIFT (1 << 16)
+#define KEY_ALT (1 << 17)
+#define KEY_CTRL (1 << 18)
+#define KEY_MODIFIERS (KEY_SHIFT | KEY_ALT | KEY_CTRL)
 
 #define HL_HIGHLIGHT_NUMBERS (1 << 0)
 #define HL_HIGHLIGHT_STRINGS (1 << 1)
@@ -60,7 +100,27 @@ enum editorKey
 	HOME_KEY,
 	END_KEY,
 	PAGE_UP,
-	PAGE_DOWN
+	PAGE_DOWN,
+	F1_KEY,
+	F2_KEY,
+	F3_KEY,
+	F4_KEY,
+	F5_KEY,
+	F6_KEY,
+	F7_KEY,
+	F8_KEY,
+	F9_KEY,
+	F10_KEY,
+	F11_KEY,
+	F12_KEY,
+	/* details are in I.mouse */
+	MOUSE_EVENT,
+	/* the followed file changed or standard input has more data */
+	FILE_EVENT,
+	/* reading the terminal failed, errno is in K.error */
+	INPUT_ERROR,
+	/* a complete sequence that is not in the key table */
+	UNKNOWN_KEY
 };
 
 enum editorHighlight
@@ -75,19 +135,157 @@ enum editorHighlight
 	HL_MATCH
 };
 
+/* run of rendered chars with the same highlight */
+typedef struct hlrun
+{
+	unsigned int len : 24;
+	unsigned int hl : 8;
+} hlrun;
+
+#define HL_RUN_MAX ((1 << 24) - 1)
+
+/* lexer state between two chars of a row */
+struct hlstate
+{
+	/* chars left of a token that started earlier, -1 for rest of row */
+	int carry;
+	unsigned char carry_hl;
+	/* quote char of an open string, or 0 */
+	char in_string;
+	unsigned char in_comment;
+	unsigned char prev_sep;
+	unsigned char prev_hl;
+};
+
+/*
+ * Piece of a long row that is rendered and highlighted on its own, so
+ * edits and drawing only touch the chunks around the cursor and the
+ * visible columns.
+ */
+struct rowchunk
+{
+	/* index into erow.chars of the first char */
+	int cx;
+	/* index into rendered row of the first char */
+	int rx;
+	int size;
+	int rsize;
+	int tabs;
+	/* expanded tabs, NULL if there are none or it was not drawn yet */
+	char *render;
+	hlrun *hl;
+	int nhl;
+	/* lexer state before the first char */
+	struct hlstate state;
+};
+
 typedef struct erow
 {
 	/* row number in file, zero-based */
 	int idx;
 	int size;
 	int rsize;
+	/* allocated size of chars */
+	int cap;
+	/*
+	 * Long rows being edited keep `gaplen` unused bytes at index `gap`,
+	 * so typing does not move the rest of the row. Code that reads chars
+	 * directly must call editorRowFlatten() first.
+	 */
 	char *chars;
+	int gap;
+	int gaplen;
+	/* same as chars if the row has no tabs to expand, NULL for long rows */
 	char *render;
-	unsigned char *hl;
+	/* allocated size of render when it is not shared with chars */
+	int rcap;
+	hlrun *hl;
+	int nhl;
+	/* long rows are split into chunks instead of having render and hl */
+	struct rowchunk *chunks;
+	int nchunks;
 	/* is a multiline comment open? */
 	int hl_open_comment;
+	/* E.gen when the text last changed */
+	long long gen;
+	/* where the row is in the file on disk and its size there, -1 if new */
+	long long orig;
+	int origsize;
+	/* bytes of the line ending after it in the file, 2 for CRLF */
+	int eol;
 } erow;
 
+struct arenaBlock
+{
+	struct arenaBlock *prev;
+	struct arenaBlock *next;
+	size_t size;
+	size_t used;
+	char data[];
+};
+
+/*
+ * Row text, render and highlight arrays are carved out of large blocks
+ * instead of being malloc()ed one by one. Space that is given back is
+ * only counted, and reclaimed by copying the live rows into fresh
+ * blocks while the editor is idle.
+ */
+struct arena
+{
+	struct arenaBlock *blocks;
+	/* block that new allocations are carved from */
+	struct arenaBlock *head;
+	/* bytes handed out */
+	size_t live;
+	/* bytes given back but not reclaimed until compaction */
+	size_t wasted;
+	size_t mapped;
+};
+
+enum undoType
+{
+	UNDO_INSERT_CHARS = 1,
+	UNDO_DELETE_CHARS,
+	UNDO_INSERT_ROW,
+	UNDO_DELETE_ROW
+};
+
+enum undoKind
+{
+	UNDO_KIND_NONE = 0,
+	UNDO_KIND_INSERT,
+	UNDO_KIND_DELETE
+};
+
+/*
+ * Journal of row operations for undo and redo. Records are packed one
+ * after another in `buf`: a struct undoRecord, `len` bytes of text and
+ * the total record size as an int, so the journal can be walked in both
+ * directions.
+ */
+struct undoJournal
+{
+	char *buf;
+	size_t len;
+	size_t cap;
+	/* records before `pos` can be undone, records after it redone */
+	size_t pos;
+	/* offset of the record that typing can be merged into, or -1 */
+	long last;
+	/* oldest edits are dropped when the journal grows beyond this */
+	size_t limit;
+	/* edits with the same group are undone together */
+	int group;
+	int kind;
+	/* group too big for the journal, its edits are not recorded */
+	int dropped;
+	/* keys handled so far and key of the last edit */
+	unsigned int keys;
+	unsigned int lastkey;
+	/* do not record operations while undoing or loading a file */
+	int suspended;
+};
+
 struct editorConfig
 {
 	/* current cursor position */
@@ -99,22 +297,379 @@ struct editorConfig
 	int rowoff;
 	/* first column of file being displayed */
 	int coloff;
+	/* first screen line being displayed in soft-wrap mode */
+	long long lineoff;
 	/* size of screen */
 	int screenrows;
 	int screencols;
 	int numrows;
+	/* allocated number of rows */
+	int rowcap;
 	erow *row;
+	/* storage for row contents */
+	struct arena arena;
 	/* is file changed since last modification? */
 	int dirty;
 	char *filename;
+	/* gzip or zstd when the file was read compressed */
+	const char *compress;
+	/* counts changes to rows, and its value when the file was saved */
+	long long gen;
+	long long savedgen;
+	/* the file on disk when it was read or saved, to notice other writers */
+	long long diskdev;
+	long long diskino;
+	long long disksize;
+	long long diskmtime;
 	char statusmsg[80];
 	time_t statusmsg_time;
 	/* file type for syntax highlighting */
 	struct editorSyntax *syntax;
+	struct undoJournal undo;
 	struct termios orig_termios;
 };
 struct editorConfig E;
 
+/*
+ * Screen lines taken up by each row in soft-wrap mode, kept as a Fenwick
+ * tree so that rows and screen lines are mapped in O(log n).
+ */
+struct wrapIndex
+{
+	int enabled;
+	/* tree[i] is the sum of lines of rows i - (i & -i) to i - 1 */
+	long long *tree;
+	/* rows in the tree */
+	int n;
+	int cap;
+	/* screen width the lines were counted for */
+	int cols;
+	/* rows were inserted or deleted, the tree must be rebuilt */
+	int stale;
+};
+struct wrapIndex W;
+
+/*
+ * Byte offsets of every KILO_LINE_INDEX_STEP-th row in the text as it
+ * would be saved, for going to a line or offset without summing every row.
+ */
+struct lineIndex
+{
+	/* offsets[k] is where row k * KILO_LINE_INDEX_STEP starts */
+	long long *offsets;
+	/* samples still valid, later ones are taken again when needed */
+	int n;
+	int cap;
+};
+struct lineIndex L;
+
+/* the window of a file kept in memory by the read-only pager */
+struct pagerState
+{
+	int active;
+	int fd;
+	long long size;
+	/* file offset of each row in the window, then the end of the last */
+	long long *offsets;
+	int cap;
+	/* bytes read from the file */
+	char *buf;
+	size_t bufcap;
+	/* where the search started, with the row then at the top of the screen */
+	long long origin;
+	long long top;
+	/* the match shown, and the first one of the query after origin */
+	long long match;
+	long long first;
+};
+struct pagerState V;
+
+/* the file followed by kilo -F as it grows */
+struct followState
+{
+	int active;
+	/* inotify instance and the watch on the file, -1 when there is none */
+	int fd;
+	int wd;
+	/* an event arrived that editorFollowCheck has not looked at */
+	int changed;
+};
+struct followState N;
+
+/*
+ * kilo - reads the file from standard input on a thread of its own. The
+ * thread fills one buffer while the editor makes rows of the other.
+ */
+struct streamState
+{
+	char *buf[2];
+	int len[2];
+	/* buffer the reader thread appends to */
+	int back;
+	/* standard input has no more data */
+	int eof;
+	/* bytes made into rows so far */
+	long long total;
+	/* the unfinished row at the end of the data taken so far */
+	char *line;
+	int linelen;
+	int linecap;
+#ifndef _WIN32
+	int fd;
+	/* the decompressor writing to fd */
+	pid_t pid;
+	/* data was added since the editor last took it */
+	atomic_int ready;
+	pthread_mutex_t lock;
+	pthread_cond_t taken;
+	pthread_t thread;
+#endif
+	int active;
+};
+struct streamState D;
+
+/*
+ * Headless replay of a keystroke trace. Keys are read from the trace
+ * instead of the terminal and output goes to an in-memory screen.
+ */
+struct replayState
+{
+	int active;
+	/* raw bytes of the trace */
+	char *keys;
+	size_t len;
+	size_t pos;
+	/* when the key being handled was read, 0 before the first key */
+	long long key_start;
+	/* handling time of every key in nanoseconds */
+	long long *latency;
+	int nkeys;
+	int cap;
+	/* bytes written to the terminal */
+	size_t bytes;
+	/* in-memory screen and its cursor */
+	char *screen;
+	int rows;
+	int cols;
+	int y;
+	int x;
+	/* scroll region, zero-based and inclusive */
+	int top;
+	int bottom;
+	/* keys read from the terminal are also written here, or -1 */
+	int record;
+};
+struct replayState R;
+
+enum perfPhase
+{
+	PERF_DECODE = 0,
+	PERF_EDIT,
+	PERF_SCROLL,
+	PERF_DRAW,
+	PERF_WRITE,
+	/* from reading a key to having written the frame showing it */
+	PERF_FRAME,
+	/* bytes written per frame, not a time */
+	PERF_BYTES,
+	PERF_PHASES
+};
+
+/*
+ * Log-linear histogram: values below 16 have a bucket each, above that
+ * every power of two is split into 8 buckets of equal width.
+ */
+#define HIST_SUB_BITS 3
+#define HIST_BUCKETS (64 << HIST_SUB_BITS)
+
+struct histogram
+{
+	unsigned long count;
+	long long sum;
+	long long max;
+	unsigned int buckets[HIST_BUCKETS];
+};
+
+/* time spent in each phase of handling keys and painting frames */
+struct perfState
+{
+	struct histogram hist[PERF_PHASES];
+	/* when the first key not painted yet was read, 0 if none */
+	long long key_start;
+	/* time spent decoding keys since key_start */
+	long long decode;
+	/* phases of the last frame */
+	long long last[PERF_PHASES];
+	/* show latency in the status bar */
+	int overlay;
+	/* histograms are written here on exit */
+	char *dump;
+};
+struct perfState P;
+
+struct traceEvent
+{
+	const char *name;
+	long long ts;
+	/* 'B' for begin or 'E' for end */
+	char ph;
+	/* optional argument of end events */
+	const char *arg;
+	long long value;
+};
+
+/*
+ * Events of one thread. Only the owning thread writes to it, so no lock
+ * is needed. When it is full the oldest events are overwritten.
+ */
+struct traceRing
+{
+	struct traceEvent *events;
+#ifndef _WIN32
+	/* number of events ever written */
+	atomic_ulong head;
+#endif
+	int tid;
+	struct traceRing *next;
+};
+
+/* Chrome trace event recording, enabled by KILO_TRACE=file */
+struct traceState
+{
+	int enabled;
+	char *path;
+	long long start;
+#ifndef _WIN32
+	_Atomic(struct traceRing *) rings;
+	atomic_int threads;
+#endif
+};
+struct traceState T;
+
+/* subsystems that memory is accounted to */
+enum memTag
+{
+	MEM_ROWS = 0,
+	MEM_CHARS,
+	MEM_RENDER,
+	MEM_HL,
+	MEM_FRAME,
+	MEM_SEARCH,
+	MEM_UNDO,
+	MEM_OTHER,
+	MEM_TAGS
+};
+
+struct memCounter
+{
+	long long live;
+	long long peak;
+	/* allocations, resizes and frees */
+	unsigned long calls;
+};
+
+struct memState
+{
+	struct memCounter tag[MEM_TAGS];
+	/* malloc()ed bytes plus mapped arena blocks */
+	struct memCounter heap;
+};
+struct memState M;
+
+/*
+ * Text rows the terminal shows, so a frame only sends rows that changed
+ * and vertical scrolls are done by the terminal.
+ */
+struct screenState
+{
+	/* hash of each text row as last drawn */
+	unsigned long long *lines;
+	/* lines[y] is what the terminal shows */
+	char *valid;
+	int rows;
+	int cols;
+	/* first screen line shown, a row or a soft-wrap line */
+	long long top;
+	/* when the last frame was painted, and the least time between frames */
+	long long painted;
+	long long interval;
+};
+struct screenState S;
+
+struct mouseEvent
+{
+	/* button and modifier bits as sent by the terminal */
+	int button;
+	int press;
+	/* zero-based screen position */
+	int x;
+	int y;
+};
+
+/* bytes read from the terminal but not yet decoded into keys */
+struct inputState
+{
+	unsigned char buf[KILO_INPUT_BUFFER];
+	int start;
+	int end;
+	/* nanoseconds before an incomplete sequence is taken as ESC */
+	long long esc_timeout;
+	struct mouseEvent mouse;
+};
+struct inputState I;
+
+struct keyEvent
+{
+	int key;
+	/* when it was decoded */
+	long long time;
+};
+
+/*
+ * Keys decoded by the input thread for the editor. There is a single
+ * producer and a single consumer, so the indices are all the
+ * synchronization needed.
+ */
+struct keyRing
+{
+	struct keyEvent events[KILO_KEY_RING];
+#ifndef _WIN32
+	/* next slot the input thread writes */
+	atomic_uint head;
+	/* next slot the editor reads */
+	atomic_uint tail;
+	/* a byte is written to wake[1] after keys are added */
+	int wake[2];
+	pthread_t thread;
+	int error;
+#endif
+	int active;
+};
+struct keyRing K;
+
+/*
+ * Frames are appended to one buffer while the output thread writes the
+ * other, so a slow terminal never holds up the editor.
+ */
+struct outputState
+{
+	char *buf[2];
+	int len[2];
+	int cap[2];
+	/* buffer the editor appends to */
+	int back;
+	/* the output thread is writing buf[!back] */
+	int busy;
+#ifndef _WIN32
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	pthread_cond_t done;
+	pthread_t thread;
+#endif
+	int active;
+};
+struct outputState O;
+
 /*** filetypes ***/
 
 char *C_HL_extensions[] = {".c", ".h", ".cpp", NULL};
@@ -145,963 +700,5750 @@ struct editorSyntax HLDB[] =
 
 /*** prototypes ***/
 
+void die(const char *s);
+void editorWrite(const char *s, int len);
+void editorQueueOutput(const char *s, int len);
+int editorDecodeKey(void);
+int editorPopKey(void);
+int editorKeyWait(long long ns);
 void editorSetStatusMessage(const char *fmt, ...);
 void editorRefreshScreen(void);
+void editorFrame(void);
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
+void editorUndoRecord(int type, int row, int at, const char *s, int len);
+void editorIdle(void);
+void editorUpdateSyntax(erow *row);
+const char *editorRowSpan(erow *row, int at, int len);
+void editorWrapRow(erow *row);
+void editorLineIndexEdit(int filerow, long long delta);
+void editorLineIndexRows(int at);
+int editorPagerEdits(int c);
+void editorPagerFind(void);
+void editorPagerSeek(long long offset);
+long long editorPagerLineOffset(long long line);
+void editorFileEvent(void);
+void editorStreamTake(void);
+#ifndef _WIN32
+void *editorStreamThread(void *arg);
+void editorStreamInit(int fd);
+#endif
 
-/*** terminal ***/
-void
-die(const char *s)
+/*** memory ***/
+
+/*
+ * All allocations go through these functions so that memory can be
+ * broken down by subsystem. Like the arena, callers pass the size of
+ * what they free.
+ */
+
+const char *mem_names[MEM_TAGS] =
 {
-#ifdef _WIN32
-	WriteConsole(GetStdHandle(STD_OUTPUT_HANDLE), "\x1b[2J", 4, NULL, NULL);
-	WriteConsole(GetStdHandle(STD_OUTPUT_HANDLE), "\x1b[H", 3, NULL, NULL);
-#else
-	write(STDOUT_FILENO, "\x1b[2J", 4);
-	write(STDOUT_FILENO, "\x1b[H", 3);
-#endif
-	perror(s);
-	exit(1);
-}
+	"rows", "chars", "render", "hl", "frame", "search", "undo", "other"
+};
 
 void
-disableRawMode(void)
+memCount(struct memCounter *c, long long delta)
 {
-#ifdef _WIN32
-	if (SetConsoleMode(GetStdHandle(STD_INPUT_HANDLE),
-		E.orig_termios.console_input_mode) == FALSE)
+	c->calls++;
+	c->live += delta;
+	if (c->live > c->peak)
 	{
-		die("SetConsoleMode");
+		c->peak = c->live;
 	}
-	if (SetConsoleMode(GetStdHandle(STD_OUTPUT_HANDLE),
-		E.orig_termios.console_output_mode) == FALSE)
+}
+
+void *
+memAlloc(int tag, size_t size)
+{
+	void *p = malloc(size);
+	if (p == NULL && size > 0)
 	{
-		die("SetConsoleMode");
+		die("malloc");
 	}
-#else
-	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1)
+	memCount(&M.tag[tag], size);
+	memCount(&M.heap, size);
+	return p;
+}
+
+void *
+memRealloc(int tag, void *p, size_t oldsize, size_t newsize)
+{
+	p = realloc(p, newsize);
+	if (p == NULL && newsize > 0)
 	{
-		die("tcsetattr");
+		die("realloc");
 	}
-#endif
+	memCount(&M.tag[tag], (long long)newsize - (long long)oldsize);
+	memCount(&M.heap, (long long)newsize - (long long)oldsize);
+	return p;
+}
+
+char *
+memStrdup(int tag, const char *s)
+{
+	size_t size = strlen(s) + 1;
+	char *p = memAlloc(tag, size);
+	memcpy(p, s, size);
+	return p;
 }
 
 void
-enableRawMode(void)
+memFree(int tag, void *p, size_t size)
 {
-#ifdef _WIN32
-	DWORD output_mode = 0;
-	if (GetConsoleMode(GetStdHandle(STD_OUTPUT_HANDLE), &output_mode) == FALSE)
+	if (p == NULL)
 	{
-		die("GetConsoleMode");
+		return;
 	}
-	E.orig_termios.console_output_mode = output_mode;
+	free(p);
+	memCount(&M.tag[tag], -(long long)size);
+	memCount(&M.heap, -(long long)size);
+}
 
-	DWORD input_mode = 0;
-	if (GetConsoleMode(GetStdHandle(STD_INPUT_HANDLE), &input_mode) == FALSE)
+/* one line per subsystem: live bytes, peak bytes and calls */
+void
+editorMemReport(FILE *fp, const char *prefix)
+{
+	int j;
+	for (j = 0; j < MEM_TAGS; j++)
 	{
-		die("GetConsoleMode");
+		fprintf(fp, "%smem_%s\t%lld\t%lld\t%lu\n", prefix, mem_names[j],
+			M.tag[j].live, M.tag[j].peak, M.tag[j].calls);
 	}
-	E.orig_termios.console_input_mode = input_mode;
-
-	atexit(disableRawMode);
+	fprintf(fp, "%smem_heap\t%lld\t%lld\t%lu\n", prefix,
+		M.heap.live, M.heap.peak, M.heap.calls);
+}
 
-	output_mode |= ENABLE_VIRTUAL_TERMINAL_PROCESSING;
-	if (SetConsoleMode(GetStdHandle(STD_OUTPUT_HANDLE), output_mode) == FALSE)
+/* bytes with a unit suffix for the message bar */
+void
+memFormat(char *buf, size_t size, long long bytes)
+{
+	if (bytes >= 1024 * 1024)
 	{
-		die("SetConsoleMode");
+		snprintf(buf, size, "%.1fM", bytes / (1024.0 * 1024.0));
 	}
-
-	input_mode |= ENABLE_VIRTUAL_TERMINAL_INPUT;
-	input_mode &= ~(ENABLE_LINE_INPUT);
-	input_mode &= ~(ENABLE_ECHO_INPUT);
-	if (SetConsoleMode(GetStdHandle(STD_INPUT_HANDLE), input_mode) == FALSE)
+	else if (bytes >= 1024)
 	{
-		die("SetConsoleMode");
+		snprintf(buf, size, "%.1fK", bytes / 1024.0);
 	}
-#else
-	if (tcgetattr(STDIN_FILENO, &E.orig_termios) == -1)
+	else
 	{
-		die("tcgetattr");
+		snprintf(buf, size, "%lld", bytes);
 	}
-	atexit(disableRawMode);
-	struct termios raw = E.orig_termios;
-	raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
-	raw.c_oflag &= ~(OPOST);
-	raw.c_cflag |= (CS8);
-	raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
-	raw.c_cc[VMIN] = 0;
-	raw.c_cc[VTIME] = 1;
-	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
+}
+
+/* show live memory by subsystem in the message bar */
+void
+editorMemStatus(void)
+{
+	char msg[256];
+	char num[2][24];
+	memFormat(num[0], sizeof(num[0]), M.heap.live);
+	memFormat(num[1], sizeof(num[1]), M.heap.peak);
+	int len = snprintf(msg, sizeof(msg), "heap %s peak %s |", num[0], num[1]);
+	int j;
+	for (j = 0; j < MEM_TAGS; j++)
 	{
-		die("tcsetattr");
+		memFormat(num[0], sizeof(num[0]), M.tag[j].live);
+		len += snprintf(&msg[len], sizeof(msg) - len, " %s %s", mem_names[j], num[0]);
 	}
-#endif
+	editorSetStatusMessage("%s", msg);
 }
 
-int
-readKeypress(void)
+/*** replay ***/
+
+/* nanoseconds from a monotonic clock */
+long long
+editorNow(void)
 {
-	char c;
+	struct timespec ts;
 #ifdef _WIN32
-	DWORD nread;
-	if (ReadConsole(GetStdHandle(STD_INPUT_HANDLE), &c, 1, &nread, NULL) == FALSE)
+	timespec_get(&ts, TIME_UTC);
+#else
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+	return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* scroll the region up by `n` lines, or down if negative */
+void
+replayScreenScroll(int n)
+{
+	int height = R.bottom - R.top + 1;
+	char *region = &R.screen[R.top * R.cols];
+	if (n == 0)
 	{
-		return -1;
+		n = 1;
 	}
-	if (nread == 0)
+	if (n >= height || -n >= height)
 	{
-		return -1;
+		memset(region, ' ', height * R.cols);
 	}
-#else
-	int nread;
-	while ((nread = read(STDIN_FILENO, &c, 1)) == 0)
+	else if (n > 0)
 	{
+		memmove(region, &region[n * R.cols], (height - n) * R.cols);
+		memset(&region[(height - n) * R.cols], ' ', n * R.cols);
 	}
-	if (nread < 0)
+	else
 	{
-		return -1;
+		memmove(&region[-n * R.cols], region, (height + n) * R.cols);
+		memset(region, ' ', -n * R.cols);
 	}
-#endif
-
-	return c;
 }
 
-int
-editorReadKey(void)
+/* apply output of the editor to the in-memory screen */
+void
+replayScreenWrite(const char *s, int len)
 {
-	int c = 0;
-
-	while (1)
-	{
-		c = readKeypress();
-		if (c != -1)
-		{
-			break;
-		}
-#ifndef _WIN32
-		if (errno != EAGAIN)
-		{
-			die("read");
-		}
-#endif
-	}
-
-	if (c == '\x1b')
+	int i = 0;
+	while (i < len)
 	{
-		char seq[3];
-		int c0 = readKeypress();
-		seq[0] = c0;
-
-		if (c0 == -1)
-		{
-			return '\x1b';
-		}
-
-		int c1 = readKeypress();
-		seq[1] = c1;
-		if (c1 == -1)
+		char c = s[i++];
+		if (c == '\x1b' && i < len && s[i] == '[')
 		{
-			return '\x1b';
-		}
-
-		if (seq[0] == '[')
-		{
-			if (seq[1] >= '0' && seq[1] <= '9')
+			/* control sequence, parameters up to the final byte */
+			int params[2] = {0, 0};
+			int nparams = 0;
+			i++;
+			while (i < len && !isalpha((unsigned char)s[i]))
 			{
-				int c2 = readKeypress();
-				seq[2] = c2;
-				if (c2 == -1)
+				if (isdigit((unsigned char)s[i]) && nparams < 2)
 				{
-					return '\x1b';
+					params[nparams] = params[nparams] * 10 + (s[i] - '0');
 				}
-
-				if (seq[2] == '~')
+				else if (s[i] == ';' && nparams < 2)
 				{
-					switch (seq[1])
-					{
-					case '1':
-						return HOME_KEY;
-					case '3':
-						return DEL_KEY;
-					case '4':
-						return END_KEY;
-					case '5':
-						return PAGE_UP;
-					case '6':
-						return PAGE_DOWN;
-					case '7':
-						return HOME_KEY;
-					case '8':
-						return END_KEY;
-					}
+					nparams++;
 				}
+				i++;
 			}
-			else
+			if (i == len)
 			{
-				switch (seq[1])
-				{
-				case 'A':
-					return ARROW_UP;
-				case 'B':
-					return ARROW_DOWN;
-				case 'C':
-					return ARROW_RIGHT;
-				case 'D':
-					return ARROW_LEFT;
-				case 'H':
-					return HOME_KEY;
-				case 'F':
-					return END_KEY;
-				}
+				break;
+			}
+			char final = s[i++];
+			if (final == 'H')
+			{
+				R.y = (params[0] > 0) ? params[0] - 1 : 0;
+				R.x = (params[1] > 0) ? params[1] - 1 : 0;
+				R.y = (R.y < R.rows) ? R.y : R.rows - 1;
+				R.x = (R.x < R.cols) ? R.x : R.cols - 1;
+			}
+			else if (final == 'K')
+			{
+				memset(&R.screen[R.y * R.cols + R.x], ' ', R.cols - R.x);
+			}
+			else if (final == 'J' && params[0] == 2)
+			{
+				memset(R.screen, ' ', R.rows * R.cols);
 			}
+			else if (final == 'r')
+			{
+				R.top = (params[0] > 0) ? params[0] - 1 : 0;
+				R.bottom = (params[1] > 0 && params[1] <= R.rows) ? params[1] - 1 : R.rows - 1;
+				R.y = 0;
+				R.x = 0;
+			}
+			else if (final == 'S' || final == 'T')
+			{
+				replayScreenScroll((final == 'S') ? params[0] : -params[0]);
+			}
+			continue;
 		}
-		else if (seq[0] == 'O')
+		if (c == '\r')
 		{
-			switch (seq[1])
+			R.x = 0;
+		}
+		else if (c == '\n')
+		{
+			if (R.y < R.rows - 1)
 			{
-			case 'H':
-				return HOME_KEY;
-			case 'F':
-				return END_KEY;
+				R.y++;
 			}
 		}
-
-		return '\x1b';
-	}
-	else
-	{
-		return c;
+		else if ((unsigned char)c >= ' ' && R.x < R.cols)
+		{
+			R.screen[R.y * R.cols + R.x++] = c;
+		}
 	}
 }
 
-#ifndef _WIN32
 int
-getCurrentPosition(int *rows, int *cols)
+replayCompare(const void *a, const void *b)
 {
-	char buf[32];
-	unsigned int i = 0;
-
-	if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4)
-	{
-		return -1;
-	}
+	long long x = *(const long long *)a;
+	long long y = *(const long long *)b;
+	return (x > y) - (x < y);
+}
 
-	/*
-	 * Parse "\x1b[24;80R" rows and columns output.
-	 */
-	while (i < sizeof(buf) - 1)
+/* print the screen to stdout and the measurements to stderr */
+void
+editorReplayReport(void)
+{
+	int y;
+	for (y = 0; y < R.rows; y++)
 	{
-		if (read(STDIN_FILENO, &buf[i], 1) != 1)
-		{
-			break;
-		}
-		if (buf[i] == 'R')
+		int len = R.cols;
+		while (len > 0 && R.screen[y * R.cols + len - 1] == ' ')
 		{
-			break;
+			len--;
 		}
-		i++;
+		printf("%.*s\n", len, &R.screen[y * R.cols]);
 	}
-	buf[i] = '\0';
 
-	if (buf[0] != '\x1b')
+	long long total = 0;
+	int j;
+	for (j = 0; j < R.nkeys; j++)
 	{
-		return -1;
+		total += R.latency[j];
 	}
-	if (buf[1] != '[')
+	if (R.nkeys > 0)
 	{
-		return -1;
+		qsort(R.latency, R.nkeys, sizeof(long long), replayCompare);
 	}
-	if (sscanf(&buf[2], "%d;%d", rows, cols) != 2)
+	fprintf(stderr, "keys\t%d\n", R.nkeys);
+	fprintf(stderr, "total_ns\t%lld\n", total);
+	fprintf(stderr, "latency_p50_ns\t%lld\n", R.nkeys ? R.latency[R.nkeys / 2] : 0);
+	fprintf(stderr, "latency_p99_ns\t%lld\n", R.nkeys ? R.latency[(int)(R.nkeys * 0.99)] : 0);
+	fprintf(stderr, "latency_max_ns\t%lld\n", R.nkeys ? R.latency[R.nkeys - 1] : 0);
+	fprintf(stderr, "bytes_emitted\t%zu\n", R.bytes);
+#ifndef _WIN32
+	struct rusage ru;
+	if (getrusage(RUSAGE_SELF, &ru) == 0)
 	{
-		return -1;
+		fprintf(stderr, "peak_rss_kb\t%ld\n", ru.ru_maxrss);
 	}
-
-	return 0;
-}
 #endif
+	editorMemReport(stderr, "");
+}
 
-int
-getWindowSize(int *rows, int *cols)
+/* replay the keys in `filename` instead of reading the terminal */
+void
+editorReplayOpen(const char *filename)
 {
-#ifdef _WIN32
-	CONSOLE_SCREEN_BUFFER_INFO csbi;
-
-	if (GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE), &csbi) == FALSE)
+	FILE *fp = fopen(filename, "rb");
+	if (fp == NULL)
 	{
-		return -1;
+		die("fopen");
 	}
-	*cols = csbi.srWindow.Right - csbi.srWindow.Left + 1;
-	*rows = csbi.srWindow.Bottom - csbi.srWindow.Top + 1;
-	return 0;
-#else
-	struct winsize ws;
+	size_t cap = 0;
+	size_t n;
+	do
+	{
+		size_t old = cap;
+		cap = (cap == 0) ? 4096 : cap * 2;
+		R.keys = memRealloc(MEM_OTHER, R.keys, old, cap);
+		n = fread(&R.keys[R.len], 1, cap - R.len, fp);
+		R.len += n;
+	} while (R.len == cap);
+	fclose(fp);
 
-	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0)
+	char *rows = getenv("LINES");
+	char *cols = getenv("COLUMNS");
+	R.rows = (rows != NULL && atoi(rows) > 2) ? atoi(rows) : 24;
+	R.cols = (cols != NULL && atoi(cols) > 0) ? atoi(cols) : 80;
+	R.screen = memAlloc(MEM_OTHER, R.rows * R.cols);
+	memset(R.screen, ' ', R.rows * R.cols);
+	R.top = 0;
+	R.bottom = R.rows - 1;
+	R.active = 1;
+	atexit(editorReplayReport);
+}
+
+/*
+ * Called before reading each key while replaying. Records how long the
+ * previous key took and ends the replay when the trace is used up.
+ */
+void
+editorReplayKey(void)
+{
+	long long now = editorNow();
+	if (R.key_start != 0)
 	{
-		if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12)
+		if (R.nkeys == R.cap)
 		{
-			return -1;
+			int old = R.cap;
+			R.cap = (R.cap == 0) ? 1024 : R.cap * 2;
+			R.latency = memRealloc(MEM_OTHER, R.latency, sizeof(long long) * old,
+				sizeof(long long) * R.cap);
 		}
-		return getCurrentPosition(rows, cols);
+		R.latency[R.nkeys++] = now - R.key_start;
 	}
-	else
+	if (R.pos == R.len && I.start == I.end)
 	{
-		*cols = ws.ws_col;
-		*rows = ws.ws_row;
-		return 0;
+		exit(0);
 	}
-#endif
+	R.key_start = now;
 }
 
-/*** syntax highlighting ***/
+/*** perf ***/
 
 int
-is_separator(int c)
+histBucket(long long v)
 {
-	return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+	if (v < 0)
+	{
+		return 0;
+	}
+	int e = 0;
+	while ((v >> e) >= (2 << HIST_SUB_BITS))
+	{
+		e++;
+	}
+	/* v >> e now has HIST_SUB_BITS + 1 bits, the top one set */
+	return ((e + 1) << HIST_SUB_BITS) + ((v >> e) & ((1 << HIST_SUB_BITS) - 1));
 }
 
-void
-editorUpdateSyntax(erow *row)
+/* smallest value that falls into bucket `i` */
+long long
+histBucketStart(int i)
 {
-	row->hl = realloc(row->hl, row->rsize);
-	memset(row->hl, HL_NORMAL, row->rsize);
-
-	if (E.syntax == NULL)
+	if (i < (2 << HIST_SUB_BITS))
 	{
-		return;
+		return i;
 	}
-	char **keywords = E.syntax->keywords;
-
-	char *scs = E.syntax->singleline_comment_start;
-	char *mcs = E.syntax->multiline_comment_start;
-	char *mce = E.syntax->multiline_comment_end;
-
-	int scs_len = scs ? strlen(scs) : 0;
-	int mcs_len = mcs ? strlen(mcs) : 0;
-	int mce_len = mce ? strlen(mce) : 0;
-
-	int prev_sep = 1;
-	int in_string = 0;
-	int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment != 0);
+	int e = (i >> HIST_SUB_BITS) - 1;
+	long long sub = i & ((1 << HIST_SUB_BITS) - 1);
+	return ((1LL << HIST_SUB_BITS) + sub) << e;
+}
 
-	int i = 0;
-	while (i < row->rsize)
+void
+histAdd(struct histogram *h, long long v)
+{
+	h->buckets[histBucket(v)]++;
+	h->count++;
+	h->sum += v;
+	if (v > h->max)
 	{
-		char c = row->render[i];
-		unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
-
-		if (scs_len > 0 && !in_string && !in_comment)
-		{
-			if (strncmp(&row->render[i], scs, scs_len) == 0)
-			{
-				/* highlight comment line */
-				memset(&row->hl[i], HL_COMMENT, row->rsize - i);
-				break;
-			}
-		}
-
-		if (mcs_len > 0 && mce_len > 0 && !in_string)
-		{
-			if (in_comment)
-			{
-				row->hl[i] = HL_MLCOMMENT;
-				if (strncmp(&row->render[i], mce, mce_len) == 0)
-				{
-					memset(&row->hl[i], HL_MLCOMMENT, mce_len);
-					i += mce_len;
-					in_comment = 0;
-					prev_sep = 0;
-					continue;
-				}
-				else
-				{
-					i++;
-					continue;
-				}
-			}
-			else if (strncmp(&row->render[i], mcs, mcs_len) == 0)
-			{
-				memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
-				i += mcs_len;
-				in_comment = 1;
-				continue;
-			}
-		}
+		h->max = v;
+	}
+}
 
-		if (E.syntax->flags & HL_HIGHLIGHT_STRINGS)
+/* upper bound of the value below which fraction `p` of the values fall */
+long long
+histPercentile(struct histogram *h, double p)
+{
+	unsigned long target = p * h->count;
+	unsigned long seen = 0;
+	int i;
+	if (target >= h->count && h->count > 0)
+	{
+		target = h->count - 1;
+	}
+	for (i = 0; i < HIST_BUCKETS; i++)
+	{
+		seen += h->buckets[i];
+		if (seen > target)
 		{
-			if (in_string)
-			{
-				row->hl[i] = HL_STRING;
-				if (c == '\\' && i + 1 < row->rsize)
-				{
-					row->hl[i + 1] = HL_STRING;
-					i += 2;
-					continue;
-				}
-				if (c == in_string)
-				{
-					/* found matching closing quote */
-					in_string = 0;
-				}
-				i++;
-				prev_sep = 1;
-				continue;
-			}
-			else
-			{
-				if (c == '"' || c == '\'')
-				{
-					in_string = c;
-					row->hl[i] = HL_STRING;
-					i++;
-					continue;
-				}
-			}
+			long long end = histBucketStart(i + 1) - 1;
+			return (end < h->max) ? end : h->max;
 		}
+	}
+	return h->max;
+}
 
-		if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS)
-		{
-			if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
-				(c == '.' && prev_hl == HL_NUMBER))
-			{
-				row->hl[i] = HL_NUMBER;
-				i++;
-				prev_sep = 0;
-				continue;
-			}
-		}
+const char *perf_names[PERF_PHASES] =
+{
+	"decode", "edit", "scroll", "draw", "write", "frame", "bytes"
+};
 
-		if (prev_sep)
+void
+editorPerfDump(void)
+{
+	FILE *fp = fopen(P.dump, "w");
+	if (fp == NULL)
+	{
+		return;
+	}
+	fprintf(fp, "# phase\tcount\tmean\tp50\tp99\tmax\n");
+	int k;
+	for (k = 0; k < PERF_PHASES; k++)
+	{
+		struct histogram *h = &P.hist[k];
+		fprintf(fp, "%s\t%lu\t%lld\t%lld\t%lld\t%lld\n", perf_names[k], h->count,
+			h->count ? h->sum / (long long)h->count : 0,
+			histPercentile(h, 0.5), histPercentile(h, 0.99), h->max);
+	}
+	fprintf(fp, "# phase\tfrom\tto\tcount\n");
+	for (k = 0; k < PERF_PHASES; k++)
+	{
+		int i;
+		for (i = 0; i < HIST_BUCKETS - 1; i++)
 		{
-			int j;
-			for (j = 0; keywords[j] != NULL; j++)
-			{
-				int klen = strlen(keywords[j]);
-				int kw2 = (keywords[j][klen -1] == '|');
-				if (kw2 != 0)
-				{
-					klen--;
-				}
-
-				if (strncmp(&row->render[i], keywords[j], klen) == 0 &&
-					is_separator(row->render[i + klen]))
-				{
-					memset(&row->hl[i], kw2 != 0 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-					i += klen;
-					break;
-				}
-			}
-			if (keywords[j] != NULL)
+			if (P.hist[k].buckets[i] != 0)
 			{
-				prev_sep = 0;
-				continue;
+				fprintf(fp, "%s\t%lld\t%lld\t%u\n", perf_names[k],
+					histBucketStart(i), histBucketStart(i + 1) - 1,
+					P.hist[k].buckets[i]);
 			}
 		}
-
-		prev_sep = is_separator(c);
-		i++;
 	}
+	fclose(fp);
+}
 
-	int changed = (row->hl_open_comment != in_comment);
-	row->hl_open_comment = in_comment;
-	if (changed && row->idx + 1 < E.numrows)
+void
+editorPerfInit(void)
+{
+	memset(&P, 0, sizeof(P));
+	P.dump = getenv("KILO_PERF_DUMP");
+	if (P.dump != NULL)
 	{
-		editorUpdateSyntax(&E.row[row->idx + 1]);
+		atexit(editorPerfDump);
 	}
 }
 
-int
-editorSyntaxToColour(int hl)
+/*
+ * A frame of `bytes` bytes was written after spending the given times
+ * scrolling, drawing and writing it. If it shows keys read since the
+ * last frame, account the time from reading the first of them.
+ */
+void
+editorPerfFrame(long long scroll, long long draw, long long output, size_t bytes)
 {
-	switch (hl)
+	if (P.key_start == 0)
 	{
-	case HL_COMMENT:
-	case HL_MLCOMMENT:
-		return 36;
-	case HL_KEYWORD1:
-		return 33;
-	case HL_KEYWORD2:
-		return 32;
-	case HL_STRING:
-		return 35;
-	case HL_NUMBER:
-		return 31;
-	case HL_MATCH:
-		return 34;
-	default:
-		return 37;
+		return;
 	}
+	long long frame = editorNow() - P.key_start;
+	P.last[PERF_DECODE] = P.decode;
+	P.last[PERF_EDIT] = frame - P.decode - scroll - draw - output;
+	P.last[PERF_SCROLL] = scroll;
+	P.last[PERF_DRAW] = draw;
+	P.last[PERF_WRITE] = output;
+	P.last[PERF_FRAME] = frame;
+	P.last[PERF_BYTES] = bytes;
+	int k;
+	for (k = 0; k < PERF_PHASES; k++)
+	{
+		histAdd(&P.hist[k], P.last[k]);
+	}
+	P.key_start = 0;
+	P.decode = 0;
 }
 
+/* format nanoseconds for the status bar */
 void
-editorSelectSyntaxHighlight(void)
+perfFormat(char *buf, size_t size, long long ns)
 {
-	E.syntax = NULL;
-	if (E.filename == NULL)
+	if (ns >= 1000000)
 	{
-		return;
+		snprintf(buf, size, "%.1fms", ns / 1e6);
 	}
-
-	char *ext = strrchr(E.filename, '.');
-	unsigned int j;
-	for (j = 0; j < HLDB_ENTRIES; j++)
+	else
 	{
-		struct editorSyntax *s = &HLDB[j];
-		unsigned int i = 0;
-		while (s->filematch[i])
-		{
-			int is_ext = (s->filematch[i][0] == '.');
-			if ((is_ext && ext && strcmp(ext, s->filematch[i]) == 0) ||
-				(!is_ext && strstr(E.filename, s->filematch[i])))
-			{
-				E.syntax = s;
-
-				int filerow;
-				for (filerow = 0; filerow < E.numrows; filerow++)
-				{
-					editorUpdateSyntax(&E.row[filerow]);
-				}
-				return;
-			}
-			i++;
-		}
+		snprintf(buf, size, "%lldus", ns / 1000);
 	}
 }
 
-/*** row operations ***/
+/*** trace ***/
 
-int
-editorRowCxToRx(erow *row, int cx)
-{
-	int rx = 0;
-	int j;
+#ifndef _WIN32
+_Thread_local struct traceRing *trace_ring;
+_Thread_local int trace_failed;
 
-	for (j = 0; j < cx; j++)
+/* ring of the calling thread, created on first use, NULL if out of memory */
+struct traceRing *
+traceRing(void)
+{
+	if (trace_ring == NULL && !trace_failed)
 	{
-		if (row->chars[j] == '\t')
+		/* not accounted, rings are created on any thread */
+		struct traceRing *ring = malloc(sizeof(struct traceRing));
+		struct traceEvent *events =
+			malloc(sizeof(struct traceEvent) * KILO_TRACE_EVENTS);
+		if (ring == NULL || events == NULL)
 		{
-			rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
+			/* the thread goes untraced */
+			free(ring);
+			free(events);
+			trace_failed = 1;
+			return NULL;
 		}
-		rx++;
+		ring->events = events;
+		atomic_init(&ring->head, 0);
+		ring->tid = atomic_fetch_add(&T.threads, 1) + 1;
+		ring->next = atomic_load(&T.rings);
+		while (!atomic_compare_exchange_weak(&T.rings, &ring->next, ring))
+		{
+		}
+		trace_ring = ring;
+	}
+	return trace_ring;
+}
+#endif
+
+void
+traceEvent(const char *name, char ph, const char *arg, long long value)
+{
+#ifndef _WIN32
+	struct traceRing *ring = traceRing();
+	if (ring == NULL)
+	{
+		return;
+	}
+	unsigned long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	struct traceEvent *ev = &ring->events[head % KILO_TRACE_EVENTS];
+	ev->name = name;
+	ev->ts = editorNow();
+	ev->ph = ph;
+	ev->arg = arg;
+	ev->value = value;
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+#else
+	(void)name;
+	(void)ph;
+	(void)arg;
+	(void)value;
+#endif
+}
+
+void
+traceBegin(const char *name)
+{
+	if (T.enabled)
+	{
+		traceEvent(name, 'B', NULL, 0);
+	}
+}
+
+void
+traceEnd(const char *name)
+{
+	if (T.enabled)
+	{
+		traceEvent(name, 'E', NULL, 0);
+	}
+}
+
+/* end event with a count shown in the trace viewer */
+void
+traceEndArg(const char *name, const char *arg, long long value)
+{
+	if (T.enabled)
+	{
+		traceEvent(name, 'E', arg, value);
+	}
+}
+
+/* write all recorded events as a Chrome/Perfetto JSON trace */
+void
+traceFlush(void)
+{
+#ifndef _WIN32
+	FILE *fp = fopen(T.path, "w");
+	if (fp == NULL)
+	{
+		return;
+	}
+	fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+	int first = 1;
+	struct traceRing *ring;
+	for (ring = atomic_load(&T.rings); ring != NULL; ring = ring->next)
+	{
+		unsigned long head = atomic_load_explicit(&ring->head, memory_order_acquire);
+		unsigned long j = (head > KILO_TRACE_EVENTS) ? head - KILO_TRACE_EVENTS : 0;
+		for (; j < head; j++)
+		{
+			struct traceEvent *ev = &ring->events[j % KILO_TRACE_EVENTS];
+			fprintf(fp, "%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,"
+				"\"pid\":%d,\"tid\":%d", first ? "" : ",", ev->name, ev->ph,
+				(ev->ts - T.start) / 1000.0, (int)getpid(), ring->tid);
+			if (ev->arg != NULL)
+			{
+				fprintf(fp, ",\"args\":{\"%s\":%lld}", ev->arg, ev->value);
+			}
+			fprintf(fp, "}");
+			first = 0;
+		}
+	}
+	fprintf(fp, "\n]}\n");
+	fclose(fp);
+#endif
+}
+
+void
+traceInit(void)
+{
+	T.path = getenv("KILO_TRACE");
+#ifndef _WIN32
+	if (T.path != NULL)
+	{
+		/* without a ring for the main thread there is no trace at all */
+		if (traceRing() == NULL)
+		{
+			return;
+		}
+		T.enabled = 1;
+		T.start = editorNow();
+		atexit(traceFlush);
+	}
+#endif
+}
+
+/*** terminal ***/
+void
+die(const char *s)
+{
+	static int dying = 0;
+	int saved = errno;
+	/* after any frames still queued for output, unless that failed */
+	if (!dying)
+	{
+		dying = 1;
+		editorWrite("\x1b[2J", 4);
+		editorWrite("\x1b[H", 3);
+	}
+	errno = saved;
+	perror(s);
+	exit(1);
+}
+
+/* write to the terminal, or to the in-memory screen when replaying */
+void
+editorWrite(const char *s, int len)
+{
+	if (R.active)
+	{
+		R.bytes += len;
+		replayScreenWrite(s, len);
+		return;
+	}
+#ifndef _WIN32
+	if (O.active)
+	{
+		editorQueueOutput(s, len);
+		return;
+	}
+#endif
+#ifdef _WIN32
+	WriteConsole(GetStdHandle(STD_OUTPUT_HANDLE), s, len, NULL, NULL);
+#else
+	write(STDOUT_FILENO, s, len);
+#endif
+}
+
+void
+disableRawMode(void)
+{
+#ifdef _WIN32
+	if (SetConsoleMode(GetStdHandle(STD_INPUT_HANDLE),
+		E.orig_termios.console_input_mode) == FALSE)
+	{
+		die("SetConsoleMode");
+	}
+	if (SetConsoleMode(GetStdHandle(STD_OUTPUT_HANDLE),
+		E.orig_termios.console_output_mode) == FALSE)
+	{
+		die("SetConsoleMode");
+	}
+#else
+	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1)
+	{
+		die("tcsetattr");
+	}
+#endif
+}
+
+void
+enableRawMode(void)
+{
+#ifdef _WIN32
+	DWORD output_mode = 0;
+	if (GetConsoleMode(GetStdHandle(STD_OUTPUT_HANDLE), &output_mode) == FALSE)
+	{
+		die("GetConsoleMode");
+	}
+	E.orig_termios.console_output_mode = output_mode;
+
+	DWORD input_mode = 0;
+	if (GetConsoleMode(GetStdHandle(STD_INPUT_HANDLE), &input_mode) == FALSE)
+	{
+		die("GetConsoleMode");
+	}
+	E.orig_termios.console_input_mode = input_mode;
+
+	atexit(disableRawMode);
+
+	output_mode |= ENABLE_VIRTUAL_TERMINAL_PROCESSING;
+	if (SetConsoleMode(GetStdHandle(STD_OUTPUT_HANDLE), output_mode) == FALSE)
+	{
+		die("SetConsoleMode");
+	}
+
+	input_mode |= ENABLE_VIRTUAL_TERMINAL_INPUT;
+	input_mode &= ~(ENABLE_LINE_INPUT);
+	input_mode &= ~(ENABLE_ECHO_INPUT);
+	if (SetConsoleMode(GetStdHandle(STD_INPUT_HANDLE), input_mode) == FALSE)
+	{
+		die("SetConsoleMode");
+	}
+#else
+	if (tcgetattr(STDIN_FILENO, &E.orig_termios) == -1)
+	{
+		die("tcgetattr");
+	}
+	atexit(disableRawMode);
+	struct termios raw = E.orig_termios;
+	raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+	raw.c_oflag &= ~(OPOST);
+	raw.c_cflag |= (CS8);
+	raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+	raw.c_cc[VMIN] = 0;
+	raw.c_cc[VTIME] = 1;
+	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
+	{
+		die("tcsetattr");
+	}
+#endif
+}
+
+/*
+ * Read whatever input is available with a single call, after the bytes
+ * not decoded yet. Returns the number of bytes read, 0 on timeout.
+ */
+int
+editorFillInput(void)
+{
+	if (I.start == I.end)
+	{
+		I.start = 0;
+		I.end = 0;
+	}
+	else if (I.end == KILO_INPUT_BUFFER)
+	{
+		memmove(I.buf, &I.buf[I.start], I.end - I.start);
+		I.end -= I.start;
+		I.start = 0;
+	}
+	int space = KILO_INPUT_BUFFER - I.end;
+
+	if (R.active)
+	{
+		int n = (R.len - R.pos < (size_t)space) ? (int)(R.len - R.pos) : space;
+		memcpy(&I.buf[I.end], &R.keys[R.pos], n);
+		R.pos += n;
+		I.end += n;
+		return n;
+	}
+#ifdef _WIN32
+	DWORD nread;
+	if (ReadConsole(GetStdHandle(STD_INPUT_HANDLE), &I.buf[I.end], space, &nread, NULL) == FALSE)
+	{
+		return -1;
+	}
+#else
+	int nread = read(STDIN_FILENO, &I.buf[I.end], space);
+	if (nread < 0)
+	{
+		return -1;
+	}
+	if (R.record != -1 && nread > 0)
+	{
+		write(R.record, &I.buf[I.end], nread);
+	}
+#endif
+	I.end += nread;
+	return nread;
+}
+
+/* wait up to `ns` nanoseconds for the terminal to send more bytes */
+int
+editorPollInput(long long ns)
+{
+#ifdef _WIN32
+	return WaitForSingleObject(GetStdHandle(STD_INPUT_HANDLE),
+		(DWORD)((ns + 999999) / 1000000)) == WAIT_OBJECT_0;
+#else
+	struct pollfd pfd;
+	pfd.fd = STDIN_FILENO;
+	pfd.events = POLLIN;
+	return poll(&pfd, 1, (int)((ns + 999999) / 1000000)) > 0;
+#endif
+}
+
+/* wait up to `ns` nanoseconds for input, return 1 if there is some */
+int
+editorInputWait(long long ns)
+{
+	if (R.active)
+	{
+		/* replayed keys arrive one at a time, every key gets a frame */
+		return 0;
+	}
+	if (K.active)
+	{
+		return editorKeyWait(ns);
+	}
+	return I.start < I.end || editorPollInput(ns);
+}
+
+int
+editorReadKey(void)
+{
+	if (R.active)
+	{
+		editorReplayKey();
+	}
+	if (K.active)
+	{
+		return editorPopKey();
+	}
+	while (I.start == I.end)
+	{
+		int n = editorFillInput();
+		if (n == -1)
+		{
+#ifndef _WIN32
+			if (errno != EAGAIN)
+#endif
+			{
+				die("read");
+			}
+		}
+		else if (n == 0)
+		{
+			editorIdle();
+		}
+	}
+
+	long long start = editorNow();
+	if (P.key_start == 0)
+	{
+		P.key_start = start;
+	}
+	int key = editorDecodeKey();
+	P.decode += editorNow() - start;
+	return key;
+}
+
+struct keyCode
+{
+	/* '[' for CSI and 'O' for SS3 sequences */
+	char intro;
+	/* first parameter of CSI sequences ending in '~', otherwise 0 */
+	int num;
+	char final;
+	int key;
+};
+
+struct keyCode key_codes[] =
+{
+	{'[', 0, 'A', ARROW_UP},
+	{'[', 0, 'B', ARROW_DOWN},
+	{'[', 0, 'C', ARROW_RIGHT},
+	{'[', 0, 'D', ARROW_LEFT},
+	{'[', 0, 'H', HOME_KEY},
+	{'[', 0, 'F', END_KEY},
+	{'[', 0, 'P', F1_KEY},
+	{'[', 0, 'Q', F2_KEY},
+	{'[', 0, 'R', F3_KEY},
+	{'[', 0, 'S', F4_KEY},
+	{'[', 1, '~', HOME_KEY},
+	{'[', 3, '~', DEL_KEY},
+	{'[', 4, '~', END_KEY},
+	{'[', 5, '~', PAGE_UP},
+	{'[', 6, '~', PAGE_DOWN},
+	{'[', 7, '~', HOME_KEY},
+	{'[', 8, '~', END_KEY},
+	{'[', 11, '~', F1_KEY},
+	{'[', 12, '~', F2_KEY},
+	{'[', 13, '~', F3_KEY},
+	{'[', 14, '~', F4_KEY},
+	{'[', 15, '~', F5_KEY},
+	{'[', 17, '~', F6_KEY},
+	{'[', 18, '~', F7_KEY},
+	{'[', 19, '~', F8_KEY},
+	{'[', 20, '~', F9_KEY},
+	{'[', 21, '~', F10_KEY},
+	{'[', 23, '~', F11_KEY},
+	{'[', 24, '~', F12_KEY},
+	{'O', 0, 'A', ARROW_UP},
+	{'O', 0, 'B', ARROW_DOWN},
+	{'O', 0, 'C', ARROW_RIGHT},
+	{'O', 0, 'D', ARROW_LEFT},
+	{'O', 0, 'H', HOME_KEY},
+	{'O', 0, 'F', END_KEY},
+	{'O', 0, 'P', F1_KEY},
+	{'O', 0, 'Q', F2_KEY},
+	{'O', 0, 'R', F3_KEY},
+	{'O', 0, 'S', F4_KEY},
+};
+
+#define KEY_CODES (int)(sizeof(key_codes) / sizeof(key_codes[0]))
+
+int
+editorLookupKey(char intro, int num, char final)
+{
+	int j;
+	for (j = 0; j < KEY_CODES; j++)
+	{
+		if (key_codes[j].intro == intro && key_codes[j].final == final &&
+			(final != '~' || key_codes[j].num == num))
+		{
+			return key_codes[j].key;
+		}
+	}
+	return UNKNOWN_KEY;
+}
+
+/* modifier parameter of xterm sequences, 1 plus the modifier bits */
+int
+editorKeyModifiers(int param)
+{
+	int bits = (param > 1) ? param - 1 : 0;
+	return ((bits & 1) ? KEY_SHIFT : 0) |
+		((bits & (2 | 8)) ? KEY_ALT : 0) |
+		((bits & 4) ? KEY_CTRL : 0);
+}
+
+/*
+ * Decode the key at the start of `s`. Returns the number of bytes it
+ * takes, or 0 if `s` ends in the middle of a sequence.
+ */
+int
+editorParseKey(const unsigned char *s, int len, int *key)
+{
+	if (s[0] != '\x1b')
+	{
+		*key = s[0];
+		return 1;
+	}
+	if (len < 2)
+	{
+		return 0;
+	}
+	if (s[1] == 'O')
+	{
+		if (len < 3)
+		{
+			return 0;
+		}
+		*key = editorLookupKey('O', 0, s[2]);
+		return 3;
+	}
+	if (s[1] != '[')
+	{
+		*key = KEY_ALT | s[1];
+		return 2;
+	}
+	if (len < 3)
+	{
+		return 0;
+	}
+	if (s[2] == 'M')
+	{
+		/* X10 mouse report, three bytes offset by 32 */
+		if (len < 6)
+		{
+			return 0;
+		}
+		I.mouse.button = (s[3] - 32) & ~3;
+		I.mouse.press = ((s[3] - 32) & 3) != 3;
+		I.mouse.x = s[4] - 33;
+		I.mouse.y = s[5] - 33;
+		*key = MOUSE_EVENT;
+		return 6;
+	}
+
+	/* parameters, intermediate bytes and a final byte */
+	int params[3] = {0, 0, 0};
+	int nparams = 0;
+	int i;
+	for (i = 2; i < len; i++)
+	{
+		unsigned char c = s[i];
+		if (c >= 0x40 && c <= 0x7e)
+		{
+			break;
+		}
+		if (c < 0x20 || c > 0x3f)
+		{
+			/* not a valid sequence, drop what came before */
+			*key = UNKNOWN_KEY;
+			return i;
+		}
+		if (isdigit(c) && nparams < 3)
+		{
+			params[nparams] = params[nparams] * 10 + (c - '0');
+		}
+		else if (c == ';')
+		{
+			nparams++;
+		}
+	}
+	if (i == len)
+	{
+		return 0;
+	}
+	char final = s[i];
+
+	if (s[2] == '<' && (final == 'M' || final == 'm'))
+	{
+		/* SGR mouse report: button;x;y, 'm' on release */
+		I.mouse.button = params[0];
+		I.mouse.press = (final == 'M');
+		I.mouse.x = params[1] - 1;
+		I.mouse.y = params[2] - 1;
+		*key = MOUSE_EVENT;
+	}
+	else if (i > 2 && s[2] >= 0x3c)
+	{
+		/* private sequences such as replies to queries */
+		*key = UNKNOWN_KEY;
+	}
+	else
+	{
+		*key = editorLookupKey('[', params[0], final);
+		if (*key != UNKNOWN_KEY)
+		{
+			*key |= editorKeyModifiers(params[1]);
+		}
+	}
+	return i + 1;
+}
+
+/*
+ * Decode the next key from the input buffer. Complete sequences are
+ * decoded without waiting, only an ESC that may start a sequence waits
+ * a short time for the rest of it.
+ */
+int
+editorDecodeKey(void)
+{
+	while (1)
+	{
+		int key;
+		int len = editorParseKey(&I.buf[I.start], I.end - I.start, &key);
+		if (len > 0)
+		{
+			I.start += len;
+			return key;
+		}
+		/* replays have the rest of the sequence at hand or never will */
+		if ((R.active || editorPollInput(I.esc_timeout)) && editorFillInput() > 0)
+		{
+			continue;
+		}
+		/* a lone ESC, or a sequence cut short which is dropped */
+		I.start = I.end;
+		return '\x1b';
+	}
+}
+
+#ifndef _WIN32
+int
+getCurrentPosition(int *rows, int *cols)
+{
+	char buf[32];
+	unsigned int i = 0;
+
+	if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4)
+	{
+		return -1;
+	}
+
+	/*
+	 * Parse "\x1b[24;80R" rows and columns output.
+	 */
+	while (i < sizeof(buf) - 1)
+	{
+		if (read(STDIN_FILENO, &buf[i], 1) != 1)
+		{
+			break;
+		}
+		if (buf[i] == 'R')
+		{
+			break;
+		}
+		i++;
+	}
+	buf[i] = '\0';
+
+	if (buf[0] != '\x1b')
+	{
+		return -1;
+	}
+	if (buf[1] != '[')
+	{
+		return -1;
+	}
+	if (sscanf(&buf[2], "%d;%d", rows, cols) != 2)
+	{
+		return -1;
+	}
+
+	return 0;
+}
+#endif
+
+int
+getWindowSize(int *rows, int *cols)
+{
+	if (R.active)
+	{
+		*rows = R.rows;
+		*cols = R.cols;
+		return 0;
+	}
+#ifdef _WIN32
+	CONSOLE_SCREEN_BUFFER_INFO csbi;
+
+	if (GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE), &csbi) == FALSE)
+	{
+		return -1;
+	}
+	*cols = csbi.srWindow.Right - csbi.srWindow.Left + 1;
+	*rows = csbi.srWindow.Bottom - csbi.srWindow.Top + 1;
+	return 0;
+#else
+	struct winsize ws;
+
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0)
+	{
+		if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12)
+		{
+			return -1;
+		}
+		return getCurrentPosition(rows, cols);
+	}
+	else
+	{
+		*cols = ws.ws_col;
+		*rows = ws.ws_row;
+		return 0;
+	}
+#endif
+}
+
+/*** threads ***/
+
+#ifndef _WIN32
+/* output thread, writes out whatever frames were queued */
+void *
+editorOutputThread(void *arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&O.lock);
+	while (1)
+	{
+		while (O.len[O.back] == 0)
+		{
+			pthread_cond_wait(&O.ready, &O.lock);
+		}
+		int front = O.back;
+		O.back = !O.back;
+		O.busy = 1;
+		pthread_mutex_unlock(&O.lock);
+
+		int done = 0;
+		while (done < O.len[front])
+		{
+			ssize_t n = write(STDOUT_FILENO, &O.buf[front][done], O.len[front] - done);
+			if (n == -1 && errno != EINTR && errno != EAGAIN)
+			{
+				/* the terminal is gone, drop the output */
+				break;
+			}
+			done += (n > 0) ? n : 0;
+		}
+
+		pthread_mutex_lock(&O.lock);
+		O.len[front] = 0;
+		O.busy = 0;
+		pthread_cond_broadcast(&O.done);
+	}
+	return NULL;
+}
+
+/* add output for the output thread, only called by the editor */
+void
+editorQueueOutput(const char *s, int len)
+{
+	pthread_mutex_lock(&O.lock);
+	int b = O.back;
+	while (O.len[b] + len > O.cap[b])
+	{
+		int cap = (O.cap[b] == 0) ? 16384 : O.cap[b];
+		while (cap < O.len[b] + len)
+		{
+			cap *= 2;
+		}
+		/* allocate unlocked, die() queues its output through here */
+		pthread_mutex_unlock(&O.lock);
+		char *buf = memAlloc(MEM_FRAME, cap);
+		pthread_mutex_lock(&O.lock);
+		b = O.back;
+		if (cap < O.len[b] + len)
+		{
+			memFree(MEM_FRAME, buf, cap);
+			continue;
+		}
+		memcpy(buf, O.buf[b], O.len[b]);
+		memFree(MEM_FRAME, O.buf[b], O.cap[b]);
+		O.buf[b] = buf;
+		O.cap[b] = cap;
+	}
+	memcpy(&O.buf[b][O.len[b]], s, len);
+	O.len[b] += len;
+	pthread_cond_signal(&O.ready);
+	pthread_mutex_unlock(&O.lock);
+}
+
+/* wait until everything queued has been written, at exit */
+void
+editorFlushOutput(void)
+{
+	pthread_mutex_lock(&O.lock);
+	while (O.len[O.back] > 0 || O.busy)
+	{
+		pthread_cond_wait(&O.done, &O.lock);
+	}
+	pthread_mutex_unlock(&O.lock);
+}
+
+/* input thread, decodes keys as soon as they arrive */
+void *
+editorInputThread(void *arg)
+{
+	(void)arg;
+	while (1)
+	{
+		int failed = 0;
+		while (I.start == I.end)
+		{
+			if (editorFillInput() == -1 && errno != EAGAIN && errno != EINTR)
+			{
+				/* the editor thread dies of it, not this one */
+				K.error = errno;
+				failed = 1;
+				break;
+			}
+		}
+		struct keyEvent ev;
+		ev.time = editorNow();
+		ev.key = failed ? INPUT_ERROR : editorDecodeKey();
+
+		unsigned head = atomic_load_explicit(&K.head, memory_order_relaxed);
+		while (head - atomic_load_explicit(&K.tail, memory_order_acquire) == KILO_KEY_RING)
+		{
+			/* the ring is full, the editor is behind */
+			poll(NULL, 0, 1);
+		}
+		K.events[head % KILO_KEY_RING] = ev;
+		atomic_store_explicit(&K.head, head + 1, memory_order_release);
+		if (write(K.wake[1], "", 1) == -1)
+		{
+			/* the pipe is full of wake ups already */
+		}
+		if (failed)
+		{
+			break;
+		}
+	}
+	return NULL;
+}
+#endif
+
+/*
+ * Wait up to `ns` nanoseconds for the input thread to decode a key.
+ * Returns 1 if one is waiting in the ring.
+ */
+int
+editorKeyWait(long long ns)
+{
+#ifndef _WIN32
+	unsigned tail = atomic_load_explicit(&K.tail, memory_order_relaxed);
+	if (tail != atomic_load_explicit(&K.head, memory_order_acquire) || N.changed ||
+		atomic_load(&D.ready))
+	{
+		return 1;
+	}
+	struct pollfd pfd[2];
+	pfd[0].fd = K.wake[0];
+	pfd[0].events = POLLIN;
+	/* poll skips negative descriptors */
+	pfd[1].fd = N.active ? N.fd : -1;
+	pfd[1].events = POLLIN;
+	pfd[1].revents = 0;
+	if (poll(pfd, 2, (int)((ns + 999999) / 1000000)) > 0)
+	{
+		char buf[64];
+		while (read(K.wake[0], buf, sizeof(buf)) > 0)
+		{
+		}
+	}
+#ifdef __linux__
+	if (pfd[1].revents & POLLIN)
+	{
+		/* events are only a hint to look at the file again */
+		char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+		ssize_t n;
+		while ((n = read(N.fd, events, sizeof(events))) > 0)
+		{
+			char *p = events;
+			while (p < events + n)
+			{
+				struct inotify_event *ev = (struct inotify_event *)p;
+				p += sizeof(struct inotify_event) + ev->len;
+				/* left over from a watch that was replaced */
+				if (N.wd == -1 || ev->wd != N.wd)
+				{
+					continue;
+				}
+				if (ev->mask & IN_MOVE_SELF)
+				{
+					/* still watching the file under its new name */
+					inotify_rm_watch(N.fd, N.wd);
+				}
+				if (ev->mask & (IN_MOVE_SELF | IN_DELETE_SELF | IN_IGNORED))
+				{
+					/* the file was rotated away, look for a new one */
+					N.wd = -1;
+				}
+				N.changed = 1;
+			}
+		}
+	}
+#endif
+	return tail != atomic_load_explicit(&K.head, memory_order_acquire) || N.changed ||
+		atomic_load(&D.ready);
+#else
+	(void)ns;
+	return 0;
+#endif
+}
+
+/* next key from the input thread, waiting for one if needed */
+int
+editorPopKey(void)
+{
+#ifndef _WIN32
+	while (!editorKeyWait(100000000))
+	{
+		if (N.active && N.wd == -1)
+		{
+			/* nothing to watch, look at the file now and then */
+			N.changed = 1;
+			break;
+		}
+		editorIdle();
+	}
+	unsigned tail = atomic_load_explicit(&K.tail, memory_order_relaxed);
+	if (tail == atomic_load_explicit(&K.head, memory_order_acquire))
+	{
+		/* woken up by a file, keys are handled first */
+		N.changed = 0;
+		return FILE_EVENT;
+	}
+	struct keyEvent ev = K.events[tail % KILO_KEY_RING];
+	atomic_store_explicit(&K.tail, tail + 1, memory_order_release);
+	if (ev.key == INPUT_ERROR)
+	{
+		/* the input thread is done after sending it */
+		pthread_join(K.thread, NULL);
+		errno = K.error;
+		die("read");
+	}
+	if (P.key_start == 0)
+	{
+		P.key_start = ev.time;
+	}
+	return ev.key;
+#else
+	/* there is no input thread */
+	return UNKNOWN_KEY;
+#endif
+}
+
+/*
+ * Move reading the terminal and writing to it to threads of their own.
+ * Replays stay on one thread so that they measure the whole path.
+ */
+void
+editorStartThreads(void)
+{
+#ifndef _WIN32
+	if (pipe(K.wake) == -1)
+	{
+		die("pipe");
+	}
+	fcntl(K.wake[0], F_SETFL, O_NONBLOCK);
+	fcntl(K.wake[1], F_SETFL, O_NONBLOCK);
+	fcntl(K.wake[0], F_SETFD, FD_CLOEXEC);
+	fcntl(K.wake[1], F_SETFD, FD_CLOEXEC);
+	if (R.active)
+	{
+		/* the whole stream is read before the first key is replayed */
+		if (D.active && pthread_create(&D.thread, NULL, editorStreamThread, NULL) != 0)
+		{
+			die("pthread_create");
+		}
+		while (D.active)
+		{
+			editorKeyWait(100000000);
+			editorStreamTake();
+		}
+		return;
+	}
+	atomic_init(&K.head, 0);
+	atomic_init(&K.tail, 0);
+	if (pthread_create(&K.thread, NULL, editorInputThread, NULL) != 0)
+	{
+		die("pthread_create");
+	}
+	K.active = 1;
+
+	pthread_mutex_init(&O.lock, NULL);
+	pthread_cond_init(&O.ready, NULL);
+	pthread_cond_init(&O.done, NULL);
+	if (pthread_create(&O.thread, NULL, editorOutputThread, NULL) != 0)
+	{
+		die("pthread_create");
+	}
+	O.active = 1;
+	atexit(editorFlushOutput);
+
+	if (D.active && pthread_create(&D.thread, NULL, editorStreamThread, NULL) != 0)
+	{
+		die("pthread_create");
+	}
+#endif
+}
+
+/*** arena ***/
+
+/* allocations larger than this get a block of their own */
+#define ARENA_BIG (KILO_ARENA_BLOCK / 4)
+
+struct arenaBlock *
+arenaMapBlock(struct arena *a, size_t size)
+{
+	size_t total = sizeof(struct arenaBlock) + size;
+#ifdef _WIN32
+	struct arenaBlock *b = malloc(total);
+	if (b == NULL)
+	{
+		die("malloc");
+	}
+#else
+	struct arenaBlock *b = mmap(NULL, total, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (b == MAP_FAILED)
+	{
+		die("mmap");
+	}
+#endif
+	memCount(&M.heap, total);
+	b->size = size;
+	b->used = 0;
+	b->prev = NULL;
+	b->next = a->blocks;
+	if (a->blocks != NULL)
+	{
+		a->blocks->prev = b;
+	}
+	a->blocks = b;
+	a->mapped += total;
+	return b;
+}
+
+void
+arenaUnmapBlock(struct arena *a, struct arenaBlock *b)
+{
+	if (b->prev != NULL)
+	{
+		b->prev->next = b->next;
+	}
+	else
+	{
+		a->blocks = b->next;
+	}
+	if (b->next != NULL)
+	{
+		b->next->prev = b->prev;
+	}
+	if (a->head == b)
+	{
+		a->head = NULL;
+	}
+
+	size_t total = sizeof(struct arenaBlock) + b->size;
+	a->mapped -= total;
+	memCount(&M.heap, -(long long)total);
+#ifdef _WIN32
+	free(b);
+#else
+	munmap(b, total);
+#endif
+}
+
+/* carve out `size` bytes without accounting them to a subsystem */
+void *
+arenaCarve(struct arena *a, size_t size, size_t align)
+{
+	if (size == 0)
+	{
+		return NULL;
+	}
+	a->live += size;
+
+	if (size > ARENA_BIG)
+	{
+		struct arenaBlock *b = arenaMapBlock(a, size);
+		b->used = size;
+		return b->data;
+	}
+
+	size_t pad = (a->head != NULL) ? (align - a->head->used % align) % align : 0;
+	if (a->head == NULL || a->head->size - a->head->used < size + pad)
+	{
+		if (a->head != NULL)
+		{
+			/* tail of the old block can never be handed out */
+			a->wasted += a->head->size - a->head->used;
+		}
+		a->head = arenaMapBlock(a, KILO_ARENA_BLOCK);
+		pad = 0;
+	}
+	a->head->used += pad;
+	a->wasted += pad;
+	void *p = &a->head->data[a->head->used];
+	a->head->used += size;
+	return p;
+}
+
+void *
+arenaAllocAligned(struct arena *a, int tag, size_t size, size_t align)
+{
+	if (size > 0)
+	{
+		memCount(&M.tag[tag], size);
+	}
+	return arenaCarve(a, size, align);
+}
+
+void *
+arenaAlloc(struct arena *a, int tag, size_t size)
+{
+	return arenaAllocAligned(a, tag, size, 1);
+}
+
+/* is `p` the most recent allocation from the head block? */
+int
+arenaIsTop(struct arena *a, void *p, size_t size)
+{
+	return a->head != NULL && size <= ARENA_BIG &&
+		(char *)p + size == &a->head->data[a->head->used];
+}
+
+void
+arenaGiveBack(struct arena *a, void *p, size_t size)
+{
+	if (p == NULL || size == 0)
+	{
+		return;
+	}
+	a->live -= size;
+
+	if (size > ARENA_BIG)
+	{
+		arenaUnmapBlock(a, (struct arenaBlock *)((char *)p - offsetof(struct arenaBlock, data)));
+	}
+	else if (arenaIsTop(a, p, size))
+	{
+		a->head->used -= size;
+	}
+	else
+	{
+		a->wasted += size;
+	}
+}
+
+void
+arenaRelease(struct arena *a, int tag, void *p, size_t size)
+{
+	if (p != NULL && size > 0)
+	{
+		memCount(&M.tag[tag], -(long long)size);
+	}
+	arenaGiveBack(a, p, size);
+}
+
+void *
+arenaRealloc(struct arena *a, int tag, void *p, size_t oldsize, size_t newsize)
+{
+	memCount(&M.tag[tag], (long long)newsize - (long long)oldsize);
+	if (p != NULL && newsize <= ARENA_BIG && arenaIsTop(a, p, oldsize) &&
+		a->head->used - oldsize + newsize <= a->head->size)
+	{
+		/* grow or shrink in place */
+		a->head->used = a->head->used - oldsize + newsize;
+		a->live = a->live - oldsize + newsize;
+		return p;
+	}
+
+	void *n = arenaCarve(a, newsize, 1);
+	if (p != NULL && n != NULL)
+	{
+		memcpy(n, p, (oldsize < newsize) ? oldsize : newsize);
+	}
+	arenaGiveBack(a, p, oldsize);
+	return n;
+}
+
+/* move an allocation from one arena to another, big blocks are relinked */
+void *
+arenaMove(struct arena *to, struct arena *from, void *p, size_t size, size_t align)
+{
+	if (p == NULL || size == 0)
+	{
+		return NULL;
+	}
+	if (size > ARENA_BIG)
+	{
+		struct arenaBlock *b = (struct arenaBlock *)((char *)p - offsetof(struct arenaBlock, data));
+		if (b->prev != NULL)
+		{
+			b->prev->next = b->next;
+		}
+		else
+		{
+			from->blocks = b->next;
+		}
+		if (b->next != NULL)
+		{
+			b->next->prev = b->prev;
+		}
+		b->prev = NULL;
+		b->next = to->blocks;
+		if (to->blocks != NULL)
+		{
+			to->blocks->prev = b;
+		}
+		to->blocks = b;
+
+		size_t total = sizeof(struct arenaBlock) + b->size;
+		from->mapped -= total;
+		from->live -= size;
+		to->mapped += total;
+		to->live += size;
+		return p;
+	}
+
+	void *n = arenaCarve(to, size, align);
+	memcpy(n, p, size);
+	from->live -= size;
+	return n;
+}
+
+void
+arenaFree(struct arena *a)
+{
+	while (a->blocks != NULL)
+	{
+		arenaUnmapBlock(a, a->blocks);
+	}
+	a->head = NULL;
+	a->live = 0;
+	a->wasted = 0;
+}
+
+/*
+ * Copy all rows into fresh blocks and unmap the old ones. Must only be
+ * called while nothing holds a pointer into row contents.
+ */
+void
+editorCompactRows(void)
+{
+	struct arena old = E.arena;
+	memset(&E.arena, 0, sizeof(E.arena));
+
+	int filerow;
+	for (filerow = 0; filerow < E.numrows; filerow++)
+	{
+		erow *row = &E.row[filerow];
+		int shared = (row->render == row->chars);
+		row->chars = arenaMove(&E.arena, &old, row->chars, row->cap, 1);
+		if (shared)
+		{
+			row->render = row->chars;
+		}
+		else
+		{
+			row->render = arenaMove(&E.arena, &old, row->render, row->rcap, 1);
+		}
+		row->hl = arenaMove(&E.arena, &old, row->hl, row->nhl * sizeof(hlrun),
+			sizeof(hlrun));
+		row->chunks = arenaMove(&E.arena, &old, row->chunks,
+			row->nchunks * sizeof(struct rowchunk), sizeof(void *));
+		int k;
+		for (k = 0; k < row->nchunks; k++)
+		{
+			struct rowchunk *ch = &row->chunks[k];
+			ch->render = arenaMove(&E.arena, &old, ch->render, ch->rsize, 1);
+			ch->hl = arenaMove(&E.arena, &old, ch->hl, ch->nhl * sizeof(hlrun),
+				sizeof(hlrun));
+		}
+	}
+	arenaFree(&old);
+}
+
+/*** syntax highlighting ***/
+
+int
+is_separator(int c)
+{
+	return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+}
+
+/* runs of the row being highlighted, copied to the row when done */
+struct hlbuf
+{
+	hlrun *runs;
+	int len;
+	int cap;
+};
+
+void
+hlAppend(struct hlbuf *hb, int hl, int len)
+{
+	while (len > 0)
+	{
+		if (hb->len > 0 && hb->runs[hb->len - 1].hl == hl &&
+			hb->runs[hb->len - 1].len < HL_RUN_MAX)
+		{
+			hlrun *last = &hb->runs[hb->len - 1];
+			int n = HL_RUN_MAX - last->len;
+			if (n > len)
+			{
+				n = len;
+			}
+			last->len += n;
+			len -= n;
+			continue;
+		}
+
+		if (hb->len == hb->cap)
+		{
+			int old = hb->cap;
+			hb->cap = (hb->cap == 0) ? 64 : hb->cap * 2;
+			hb->runs = memRealloc(MEM_HL, hb->runs, sizeof(hlrun) * old,
+				sizeof(hlrun) * hb->cap);
+		}
+		hb->runs[hb->len].len = 0;
+		hb->runs[hb->len].hl = hl;
+		hb->len++;
+	}
+}
+
+/* position in the runs of a row, for looking up the highlight of a column */
+struct hlcursor
+{
+	const hlrun *hl;
+	int nhl;
+	int run;
+	/* render column where `run` starts */
+	int rx;
+};
+
+int
+hlCursorAt(struct hlcursor *c, int rx)
+{
+	if (c->nhl == 0)
+	{
+		return HL_NORMAL;
+	}
+	while (c->run > 0 && rx < c->rx)
+	{
+		c->run--;
+		c->rx -= c->hl[c->run].len;
+	}
+	while (c->run < c->nhl - 1 && rx >= c->rx + (int)c->hl[c->run].len)
+	{
+		c->rx += c->hl[c->run].len;
+		c->run++;
+	}
+	return c->hl[c->run].hl;
+}
+
+/* text being highlighted */
+struct hltext
+{
+	const char *s;
+	/* number of chars to highlight */
+	int len;
+	/* number of chars that can be read to recognise a token */
+	int n;
+	/* render column of the next char */
+	int rx;
+};
+
+int
+editorTextWidth(const char *s, int n, int rx)
+{
+	int j;
+	for (j = 0; j < n; j++)
+	{
+		if (s[j] == '\t')
+		{
+			rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
+		}
+		rx++;
+	}
+	return rx;
+}
+
+/*
+ * Highlight `count` chars starting at `i`. A token running past the end
+ * of the text is cut off and the rest is carried over in the state.
+ */
+void
+hlEmit(struct hltext *t, struct hlbuf *hb, struct hlstate *st, int i, int count, int hl)
+{
+	if (count < 0 || i + count > t->len)
+	{
+		st->carry = (count < 0) ? -1 : i + count - t->len;
+		st->carry_hl = hl;
+		count = t->len - i;
+	}
+	int rx = editorTextWidth(&t->s[i], count, t->rx);
+	hlAppend(hb, hl, rx - t->rx);
+	t->rx = rx;
+	st->prev_hl = hl;
+}
+
+/* chars a token can extend beyond the point where it is recognised */
+int
+editorSyntaxLookahead(void)
+{
+	if (E.syntax == NULL)
+	{
+		return 0;
+	}
+	int lookahead = 2;
+	char *delims[3];
+	delims[0] = E.syntax->singleline_comment_start;
+	delims[1] = E.syntax->multiline_comment_start;
+	delims[2] = E.syntax->multiline_comment_end;
+	int j;
+	for (j = 0; j < 3; j++)
+	{
+		if (delims[j] != NULL && (int)strlen(delims[j]) > lookahead)
+		{
+			lookahead = strlen(delims[j]);
+		}
+	}
+	for (j = 0; E.syntax->keywords[j] != NULL; j++)
+	{
+		/* keyword plus the separator after it */
+		if ((int)strlen(E.syntax->keywords[j]) + 1 > lookahead)
+		{
+			lookahead = strlen(E.syntax->keywords[j]) + 1;
+		}
+	}
+	return lookahead;
+}
+
+void
+editorHlInitState(struct hlstate *st, int in_comment)
+{
+	st->carry = 0;
+	st->carry_hl = HL_NORMAL;
+	st->in_string = 0;
+	st->in_comment = in_comment;
+	st->prev_sep = 1;
+	st->prev_hl = HL_NORMAL;
+}
+
+int
+editorHlStateEqual(const struct hlstate *a, const struct hlstate *b)
+{
+	return a->carry == b->carry && a->carry_hl == b->carry_hl &&
+		a->in_string == b->in_string && a->in_comment == b->in_comment &&
+		a->prev_sep == b->prev_sep && a->prev_hl == b->prev_hl;
+}
+
+/*
+ * Highlight the chars of `t` starting in state `st`, appending runs to
+ * `hb`. On return `st` is the state after the last char.
+ */
+void
+editorHighlightText(struct hltext *t, struct hlstate *st, struct hlbuf *hb)
+{
+	const char *s = t->s;
+	int i = 0;
+
+	if (st->carry != 0)
+	{
+		int count = st->carry;
+		st->carry = 0;
+		hlEmit(t, hb, st, 0, count, st->carry_hl);
+		i = (count < 0 || count > t->len) ? t->len : count;
+	}
+
+	if (E.syntax == NULL)
+	{
+		if (i < t->len)
+		{
+			hlEmit(t, hb, st, i, t->len - i, HL_NORMAL);
+		}
+		return;
+	}
+	char **keywords = E.syntax->keywords;
+
+	char *scs = E.syntax->singleline_comment_start;
+	char *mcs = E.syntax->multiline_comment_start;
+	char *mce = E.syntax->multiline_comment_end;
+
+	int scs_len = scs ? strlen(scs) : 0;
+	int mcs_len = mcs ? strlen(mcs) : 0;
+	int mce_len = mce ? strlen(mce) : 0;
+
+	while (i < t->len)
+	{
+		char c = s[i];
+
+		if (scs_len > 0 && !st->in_string && !st->in_comment)
+		{
+			if (strncmp(&s[i], scs, scs_len) == 0)
+			{
+				/* highlight comment line */
+				hlEmit(t, hb, st, i, -1, HL_COMMENT);
+				break;
+			}
+		}
+
+		if (mcs_len > 0 && mce_len > 0 && !st->in_string)
+		{
+			if (st->in_comment)
+			{
+				if (strncmp(&s[i], mce, mce_len) == 0)
+				{
+					hlEmit(t, hb, st, i, mce_len, HL_MLCOMMENT);
+					i += mce_len;
+					st->in_comment = 0;
+					st->prev_sep = 0;
+					continue;
+				}
+				else
+				{
+					hlEmit(t, hb, st, i, 1, HL_MLCOMMENT);
+					i++;
+					continue;
+				}
+			}
+			else if (strncmp(&s[i], mcs, mcs_len) == 0)
+			{
+				hlEmit(t, hb, st, i, mcs_len, HL_MLCOMMENT);
+				i += mcs_len;
+				st->in_comment = 1;
+				continue;
+			}
+		}
+
+		if (E.syntax->flags & HL_HIGHLIGHT_STRINGS)
+		{
+			if (st->in_string)
+			{
+				if (c == '\\' && i + 1 < t->n)
+				{
+					hlEmit(t, hb, st, i, 2, HL_STRING);
+					i += 2;
+					continue;
+				}
+				hlEmit(t, hb, st, i, 1, HL_STRING);
+				if (c == st->in_string)
+				{
+					/* found matching closing quote */
+					st->in_string = 0;
+				}
+				i++;
+				st->prev_sep = 1;
+				continue;
+			}
+			else
+			{
+				if (c == '"' || c == '\'')
+				{
+					st->in_string = c;
+					hlEmit(t, hb, st, i, 1, HL_STRING);
+					i++;
+					continue;
+				}
+			}
+		}
+
+		if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS)
+		{
+			if ((isdigit(c) && (st->prev_sep || st->prev_hl == HL_NUMBER)) ||
+				(c == '.' && st->prev_hl == HL_NUMBER))
+			{
+				hlEmit(t, hb, st, i, 1, HL_NUMBER);
+				i++;
+				st->prev_sep = 0;
+				continue;
+			}
+		}
+
+		if (st->prev_sep)
+		{
+			int j;
+			for (j = 0; keywords[j] != NULL; j++)
+			{
+				int klen = strlen(keywords[j]);
+				int kw2 = (keywords[j][klen -1] == '|');
+				if (kw2 != 0)
+				{
+					klen--;
+				}
+
+				if (strncmp(&s[i], keywords[j], klen) == 0 &&
+					is_separator(s[i + klen]))
+				{
+					hlEmit(t, hb, st, i, klen, kw2 != 0 ? HL_KEYWORD2 : HL_KEYWORD1);
+					i += klen;
+					break;
+				}
+			}
+			if (keywords[j] != NULL)
+			{
+				st->prev_sep = 0;
+				continue;
+			}
+		}
+
+		hlEmit(t, hb, st, i, 1, HL_NORMAL);
+		st->prev_sep = is_separator(c);
+		i++;
+	}
+}
+
+/* highlight chunk `k` of a long row, starting from the state in `st` */
+void
+editorHighlightChunk(erow *row, int k, struct hlstate *st)
+{
+	static struct hlbuf hb = {NULL, 0, 0};
+	hb.len = 0;
+
+	struct rowchunk *ch = &row->chunks[k];
+	struct hltext t;
+	t.len = ch->size;
+	t.n = row->size - ch->cx;
+	if (t.n > t.len + editorSyntaxLookahead())
+	{
+		t.n = t.len + editorSyntaxLookahead();
+	}
+	t.s = editorRowSpan(row, ch->cx, t.n);
+	t.rx = ch->rx;
+	editorHighlightText(&t, st, &hb);
+
+	arenaRelease(&E.arena, MEM_HL, ch->hl, ch->nhl * sizeof(hlrun));
+	ch->hl = arenaAllocAligned(&E.arena, MEM_HL, hb.len * sizeof(hlrun), sizeof(hlrun));
+	if (hb.len > 0)
+	{
+		memcpy(ch->hl, hb.runs, hb.len * sizeof(hlrun));
+	}
+	ch->nhl = hb.len;
+}
+
+/* multiline comment state at the end of a row changed, update next row */
+void
+editorSyntaxRowEnd(erow *row, int in_comment)
+{
+	/* rows rehighlighted by the chain of changes in progress */
+	static int chain;
+	int changed = (row->hl_open_comment != in_comment);
+	row->hl_open_comment = in_comment;
+	if (changed && row->idx + 1 < E.numrows)
+	{
+		if (chain++ == 0)
+		{
+			traceBegin("editorUpdateSyntax chain");
+			editorUpdateSyntax(&E.row[row->idx + 1]);
+			traceEndArg("editorUpdateSyntax chain", "rows", chain);
+			chain = 0;
+		}
+		else
+		{
+			editorUpdateSyntax(&E.row[row->idx + 1]);
+		}
+	}
+}
+
+void
+editorUpdateSyntax(erow *row)
+{
+	static struct hlbuf hb = {NULL, 0, 0};
+	hb.len = 0;
+
+	struct hlstate st;
+	editorHlInitState(&st, row->idx > 0 && E.row[row->idx - 1].hl_open_comment != 0);
+
+	if (row->nchunks > 0)
+	{
+		int k;
+		for (k = 0; k < row->nchunks; k++)
+		{
+			row->chunks[k].state = st;
+			editorHighlightChunk(row, k, &st);
+		}
+		editorSyntaxRowEnd(row, st.in_comment);
+		return;
+	}
+
+	struct hltext t;
+	t.s = row->chars;
+	t.len = row->size;
+	t.n = row->size;
+	t.rx = 0;
+	editorHighlightText(&t, &st, &hb);
+
+	arenaRelease(&E.arena, MEM_HL, row->hl, row->nhl * sizeof(hlrun));
+	row->hl = arenaAllocAligned(&E.arena, MEM_HL, hb.len * sizeof(hlrun), sizeof(hlrun));
+	if (hb.len > 0)
+	{
+		memcpy(row->hl, hb.runs, hb.len * sizeof(hlrun));
+	}
+	row->nhl = hb.len;
+
+	editorSyntaxRowEnd(row, st.in_comment);
+}
+
+/*
+ * Highlight a short row again after `n` chars were inserted at `at`, or
+ * -n chars deleted there. `rx` is the render column of `at`, and chars
+ * from `fixed` on moved by `delta` columns. After a separator that was
+ * highlighted as normal text the lexer is back in its initial state, so
+ * lexing resumes after the last one the edit cannot affect, and stops at
+ * the first one after the edit that was also normal before it.
+ */
+void
+editorUpdateSyntaxEdit(erow *row, int at, int n, int rx, int fixed, int delta)
+{
+	static struct hlbuf hb = {NULL, 0, 0};
+	hb.len = 0;
+
+	struct hlcursor old = {row->hl, row->nhl, 0, 0};
+	int lookahead = editorSyntaxLookahead();
+
+	/* find where to resume lexing */
+	int start = 0;
+	int start_rx = 0;
+	int col = rx;
+	int j;
+	for (j = at - 1; j >= 0; j--)
+	{
+		if (j <= at - lookahead && is_separator(row->chars[j]) &&
+			hlCursorAt(&old, col - 1) == HL_NORMAL)
+		{
+			start = j + 1;
+			start_rx = col;
+			break;
+		}
+		/* the column a tab starts at depends on the chars before it */
+		col = (row->chars[j] == '\t') ? editorTextWidth(row->chars, j, 0) : col - 1;
+	}
+
+	/* runs before that are kept */
+	int pos = 0;
+	int k;
+	for (k = 0; k < row->nhl && pos < start_rx; k++)
+	{
+		int len = row->hl[k].len;
+		hlAppend(&hb, row->hl[k].hl, (pos + len > start_rx) ? start_rx - pos : len);
+		pos += len;
+	}
+
+	struct hlstate st;
+	editorHlInitState(&st, start == 0 && row->idx > 0 &&
+		E.row[row->idx - 1].hl_open_comment != 0);
+	struct hltext t;
+	t.rx = start_rx;
+
+	int stop = at + ((n > 0) ? n : 0) + 1;
+	if (stop < fixed)
+	{
+		stop = fixed;
+	}
+	int resume = -1;
+	int i = start;
+	while (i < row->size)
+	{
+		/* lex up to a separator, where the state can be compared */
+		int end = (stop > i + 1) ? stop : i + 1;
+		while (end < row->size && !is_separator(row->chars[end - 1]))
+		{
+			end++;
+		}
+		if (end > row->size)
+		{
+			end = row->size;
+		}
+		t.s = &row->chars[i];
+		t.len = end - i;
+		t.n = row->size - i;
+		editorHighlightText(&t, &st, &hb);
+		i = end;
+
+		if (i < row->size && st.carry == 0 && !st.in_string && !st.in_comment &&
+			st.prev_sep && st.prev_hl == HL_NORMAL &&
+			hlCursorAt(&old, t.rx - 1 - delta) == HL_NORMAL)
+		{
+			resume = t.rx - delta;
+			break;
+		}
+	}
+
+	/* runs after that are kept, moved along with their chars */
+	if (resume >= 0)
+	{
+		hlCursorAt(&old, resume);
+		hlAppend(&hb, row->hl[old.run].hl, old.rx + row->hl[old.run].len - resume);
+		for (k = old.run + 1; k < row->nhl; k++)
+		{
+			hlAppend(&hb, row->hl[k].hl, row->hl[k].len);
+		}
+	}
+
+	arenaRelease(&E.arena, MEM_HL, row->hl, row->nhl * sizeof(hlrun));
+	row->hl = arenaAllocAligned(&E.arena, MEM_HL, hb.len * sizeof(hlrun), sizeof(hlrun));
+	if (hb.len > 0)
+	{
+		memcpy(row->hl, hb.runs, hb.len * sizeof(hlrun));
+	}
+	row->nhl = hb.len;
+
+	if (resume < 0)
+	{
+		editorSyntaxRowEnd(row, st.in_comment);
+	}
+}
+
+int
+editorSyntaxToColour(int hl)
+{
+	switch (hl)
+	{
+	case HL_COMMENT:
+	case HL_MLCOMMENT:
+		return 36;
+	case HL_KEYWORD1:
+		return 33;
+	case HL_KEYWORD2:
+		return 32;
+	case HL_STRING:
+		return 35;
+	case HL_NUMBER:
+		return 31;
+	case HL_MATCH:
+		return 34;
+	default:
+		return 37;
+	}
+}
+
+void
+editorSelectSyntaxHighlight(void)
+{
+	E.syntax = NULL;
+	if (E.filename == NULL)
+	{
+		return;
+	}
+
+	char *ext = strrchr(E.filename, '.');
+	unsigned int j;
+	for (j = 0; j < HLDB_ENTRIES; j++)
+	{
+		struct editorSyntax *s = &HLDB[j];
+		unsigned int i = 0;
+		while (s->filematch[i])
+		{
+			int is_ext = (s->filematch[i][0] == '.');
+			if ((is_ext && ext && strcmp(ext, s->filematch[i]) == 0) ||
+				(!is_ext && strstr(E.filename, s->filematch[i])))
+			{
+				E.syntax = s;
+
+				int filerow;
+				for (filerow = 0; filerow < E.numrows; filerow++)
+				{
+					editorUpdateSyntax(&E.row[filerow]);
+				}
+				return;
+			}
+			i++;
+		}
+	}
+}
+
+/*** row operations ***/
+
+/*
+ * Pointer to `len` chars of a row starting at `at`, followed by the next
+ * char or the terminating nul. Chars on both sides of the gap are copied
+ * into a buffer that is valid until the next call.
+ */
+const char *
+editorRowSpan(erow *row, int at, int len)
+{
+	static char *buf = NULL;
+	static int cap = 0;
+
+	if (row->gaplen == 0 || at + len < row->gap)
+	{
+		return &row->chars[at];
+	}
+	if (at >= row->gap)
+	{
+		return &row->chars[at + row->gaplen];
+	}
+	if (len + 1 > cap)
+	{
+		buf = memRealloc(MEM_CHARS, buf, cap, len + 1);
+		cap = len + 1;
+	}
+	int before = row->gap - at;
+	memcpy(buf, &row->chars[at], before);
+	memcpy(&buf[before], &row->chars[row->gap + row->gaplen], len - before + 1);
+	return buf;
+}
+
+/* close the gap, so chars holds the row contiguously */
+void
+editorRowFlatten(erow *row)
+{
+	if (row->gaplen == 0)
+	{
+		return;
+	}
+	memmove(&row->chars[row->gap], &row->chars[row->gap + row->gaplen],
+		row->size - row->gap + 1);
+	row->gap = row->size;
+	row->gaplen = 0;
+}
+
+/* move the gap to `at`, the chars in between move across it */
+void
+editorRowMoveGap(erow *row, int at)
+{
+	if (row->gaplen == 0)
+	{
+		row->gap = at;
+		return;
+	}
+	if (at < row->gap)
+	{
+		memmove(&row->chars[at + row->gaplen], &row->chars[at], row->gap - at);
+	}
+	else if (at > row->gap)
+	{
+		memmove(&row->chars[row->gap], &row->chars[row->gap + row->gaplen], at - row->gap);
+	}
+	row->gap = at;
+}
+
+/* make room for inserting `len` chars at `at` */
+void
+editorRowOpenGap(erow *row, int at, int len)
+{
+	if (row->gaplen < len)
+	{
+		editorRowFlatten(row);
+		if (row->size + len + 1 > row->cap)
+		{
+			int cap = row->cap * 2;
+			if (cap < row->size + len + 1)
+			{
+				cap = row->size + len + 1;
+			}
+			row->chars = arenaRealloc(&E.arena, MEM_CHARS, row->chars, row->cap, cap);
+			row->cap = cap;
+		}
+		/* all spare capacity becomes the gap */
+		int gaplen = row->cap - row->size - 1;
+		memmove(&row->chars[at + gaplen], &row->chars[at], row->size - at + 1);
+		row->gap = at;
+		row->gaplen = gaplen;
+		return;
+	}
+	editorRowMoveGap(row, at);
+}
+
+/* chunk of a long row containing char `cx` */
+int
+editorRowChunk(erow *row, int cx)
+{
+	int lo = 0;
+	int hi = row->nchunks - 1;
+	while (lo < hi)
+	{
+		int mid = lo + (hi - lo + 1) / 2;
+		if (row->chunks[mid].cx <= cx)
+		{
+			lo = mid;
+		}
+		else
+		{
+			hi = mid - 1;
+		}
+	}
+	return lo;
+}
+
+/* chunk of a long row containing render column `rx` */
+int
+editorRowChunkByRx(erow *row, int rx)
+{
+	int lo = 0;
+	int hi = row->nchunks - 1;
+	while (lo < hi)
+	{
+		int mid = lo + (hi - lo + 1) / 2;
+		if (row->chunks[mid].rx <= rx)
+		{
+			lo = mid;
+		}
+		else
+		{
+			hi = mid - 1;
+		}
+	}
+	return lo;
+}
+
+int
+editorRowCxToRx(erow *row, int cx)
+{
+	if (row->render == row->chars)
+	{
+		return cx;
+	}
+	if (row->nchunks > 0)
+	{
+		struct rowchunk *ch = &row->chunks[editorRowChunk(row, cx)];
+		if (ch->tabs == 0)
+		{
+			return ch->rx + (cx - ch->cx);
+		}
+		return editorTextWidth(editorRowSpan(row, ch->cx, cx - ch->cx),
+			cx - ch->cx, ch->rx);
+	}
+	return editorTextWidth(row->chars, cx, 0);
+}
+
+int
+editorRowRxToCx(erow *row, int rx)
+{
+	int cur_rx = 0;
+	int base = 0;
+	int len = row->size;
+	const char *s = row->chars;
+
+	if (row->render == row->chars)
+	{
+		return (rx < row->size) ? rx : row->size;
+	}
+	if (row->nchunks > 0)
+	{
+		struct rowchunk *ch = &row->chunks[editorRowChunkByRx(row, rx)];
+		cur_rx = ch->rx;
+		base = ch->cx;
+		len = ch->size;
+		s = editorRowSpan(row, ch->cx, ch->size);
+	}
+
+	int j;
+	for (j = 0; j < len; j++)
+	{
+		if (s[j] == '\t')
+		{
+			cur_rx += (KILO_TAB_STOP - 1) - (cur_rx % KILO_TAB_STOP);
+		}
+		cur_rx++;
+
+		if (cur_rx > rx)
+		{
+			break;
+		}
+	}
+	return base + j;
+}
+
+/*
+ * Render of a chunk. Tabs are only expanded once the chunk is drawn, and
+ * chunks without tabs are drawn from chars unless they contain the gap.
+ */
+char *
+editorChunkRender(erow *row, struct rowchunk *ch)
+{
+	if (ch->render != NULL)
+	{
+		return ch->render;
+	}
+	if (ch->tabs == 0 && (row->gaplen == 0 || ch->cx + ch->size <= row->gap))
+	{
+		return &row->chars[ch->cx];
+	}
+	if (ch->tabs == 0 && ch->cx >= row->gap)
+	{
+		return &row->chars[ch->cx + row->gaplen];
+	}
+
+	const char *s = editorRowSpan(row, ch->cx, ch->size);
+	ch->render = arenaAlloc(&E.arena, MEM_RENDER, ch->rsize);
+	int idx = 0;
+	int j;
+	for (j = 0; j < ch->size; j++)
+	{
+		if (s[j] == '\t')
+		{
+			ch->render[idx++] = ' ';
+			while ((ch->rx + idx) % KILO_TAB_STOP != 0)
+			{
+				ch->render[idx++] = ' ';
+			}
+		}
+		else
+		{
+			ch->render[idx++] = s[j];
+		}
+	}
+	return ch->render;
+}
+
+void
+editorFreeChunk(struct rowchunk *ch)
+{
+	arenaRelease(&E.arena, MEM_HL, ch->hl, ch->nhl * sizeof(hlrun));
+	ch->hl = NULL;
+	ch->nhl = 0;
+	arenaRelease(&E.arena, MEM_RENDER, ch->render, ch->rsize);
+	ch->render = NULL;
+}
+
+void
+editorFreeChunks(erow *row)
+{
+	int k;
+	for (k = 0; k < row->nchunks; k++)
+	{
+		editorFreeChunk(&row->chunks[k]);
+	}
+	arenaRelease(&E.arena, MEM_ROWS, row->chunks, row->nchunks * sizeof(struct rowchunk));
+	row->chunks = NULL;
+	row->nchunks = 0;
+}
+
+/* count tabs and rendered width of a chunk whose cx, rx and size are set */
+void
+editorScanChunk(erow *row, struct rowchunk *ch)
+{
+	const char *s = editorRowSpan(row, ch->cx, ch->size);
+	int tabs = 0;
+	int j;
+	for (j = 0; j < ch->size; j++)
+	{
+		if (s[j] == '\t')
+		{
+			tabs++;
+		}
+	}
+	ch->tabs = tabs;
+	ch->rsize = (tabs == 0) ? ch->size : editorTextWidth(s, ch->size, ch->rx) - ch->rx;
+}
+
+/*
+ * Replace chunks `lo` to `hi` with `pieces` chunks covering `size` chars
+ * starting at the first char of chunk `lo`. The new chunks are scanned
+ * but not highlighted.
+ */
+void
+editorRechunk(erow *row, int lo, int hi, int pieces, int size)
+{
+	int cx = (row->nchunks > 0) ? row->chunks[lo].cx : 0;
+	int rx = (row->nchunks > 0) ? row->chunks[lo].rx : 0;
+	int k;
+	for (k = lo; k <= hi && k < row->nchunks; k++)
+	{
+		editorFreeChunk(&row->chunks[k]);
+	}
+
+	int removed = (row->nchunks > 0) ? hi - lo + 1 : 0;
+	int nchunks = row->nchunks - removed + pieces;
+	if (nchunks != row->nchunks)
+	{
+		struct rowchunk *chunks = arenaAllocAligned(&E.arena, MEM_ROWS,
+			nchunks * sizeof(struct rowchunk), sizeof(void *));
+		if (lo > 0)
+		{
+			memcpy(chunks, row->chunks, lo * sizeof(struct rowchunk));
+		}
+		if (row->nchunks - lo - removed > 0)
+		{
+			memcpy(&chunks[lo + pieces], &row->chunks[lo + removed],
+				(row->nchunks - lo - removed) * sizeof(struct rowchunk));
+		}
+		arenaRelease(&E.arena, MEM_ROWS, row->chunks, row->nchunks * sizeof(struct rowchunk));
+		row->chunks = chunks;
+		row->nchunks = nchunks;
+	}
+
+	for (k = 0; k < pieces; k++)
+	{
+		struct rowchunk *ch = &row->chunks[lo + k];
+		ch->cx = cx;
+		ch->rx = rx;
+		ch->size = (k == pieces - 1) ? size - (pieces - 1) * (size / pieces) : size / pieces;
+		ch->render = NULL;
+		ch->hl = NULL;
+		ch->nhl = 0;
+		editorScanChunk(row, ch);
+		cx += ch->size;
+		rx += ch->rsize;
+	}
+}
+
+void
+editorUpdateRow(erow *row)
+{
+	int j;
+
+	editorRowFlatten(row);
+	/* release in reverse order, so the last edited row is reused in place */
+	arenaRelease(&E.arena, MEM_HL, row->hl, row->nhl * sizeof(hlrun));
+	row->hl = NULL;
+	row->nhl = 0;
+	if (row->render != row->chars)
+	{
+		arenaRelease(&E.arena, MEM_RENDER, row->render, row->rcap);
+	}
+	row->render = NULL;
+	row->rcap = 0;
+	editorFreeChunks(row);
+
+	if (row->size > KILO_LONG_ROW)
+	{
+		int pieces = (row->size + KILO_CHUNK_SIZE - 1) / KILO_CHUNK_SIZE;
+		editorRechunk(row, 0, 0, pieces, row->size);
+		struct rowchunk *last = &row->chunks[row->nchunks - 1];
+		row->rsize = last->rx + last->rsize;
+		editorUpdateSyntax(row);
+		return;
+	}
+
+	if (memchr(row->chars, '\t', row->size) == NULL)
+	{
+		/* no tabs, render is identical to chars */
+		row->render = row->chars;
+		row->rsize = row->size;
+		editorUpdateSyntax(row);
+		return;
+	}
+	int rsize = editorTextWidth(row->chars, row->size, 0);
+	row->render = arenaAlloc(&E.arena, MEM_RENDER, rsize + 1);
+	row->rcap = rsize + 1;
+
+	int idx = 0;
+	for (j = 0; j < row->size; j++)
+	{
+		if (row->chars[j] == '\t')
+		{
+			row->render[idx++] = ' ';
+			while (idx % KILO_TAB_STOP != 0)
+			{
+				row->render[idx++] = ' ';
+			}
+		}
+		else
+		{
+			row->render[idx++] = row->chars[j];
+		}
+	}
+	row->render[idx] = '\0';
+	row->rsize = idx;
+
+	editorUpdateSyntax(row);
+}
+
+/*
+ * Update a short row after `n` chars were inserted at `at`, or -n chars
+ * deleted there. `tab` tells whether these chars include a tab. Render
+ * is patched in place up to the first tab after the edit, since later
+ * columns move by whole tab stops.
+ */
+void
+editorUpdateRowEdit(erow *row, int at, int n, int tab)
+{
+	if (row->size > KILO_LONG_ROW || (tab && (n < 0 || row->render == row->chars)))
+	{
+		editorUpdateRow(row);
+		return;
+	}
+
+	int rx = editorRowCxToRx(row, at);
+	int fixed = at + ((n > 0) ? n : 0);
+	int delta = n;
+	if (row->render == row->chars)
+	{
+		row->rsize = row->size;
+		editorUpdateSyntaxEdit(row, at, n, rx, fixed, delta);
+		return;
+	}
+
+	char *next = memchr(&row->chars[fixed], '\t', row->size - fixed);
+	fixed = (next != NULL) ? next - row->chars + 1 : row->size;
+	int end = editorTextWidth(&row->chars[at], fixed - at, rx);
+	int old_end = (n > 0) ?
+		editorTextWidth(&row->chars[at + n], fixed - at - n, rx) :
+		editorTextWidth(&row->chars[at], fixed - at, rx - n);
+	delta = end - old_end;
+
+	int rsize = row->rsize + delta;
+	if (rsize + 1 > row->rcap)
+	{
+		int rcap = row->rcap * 2;
+		if (rcap < rsize + 1)
+		{
+			rcap = rsize + 1;
+		}
+		row->render = arenaRealloc(&E.arena, MEM_RENDER, row->render, row->rcap, rcap);
+		row->rcap = rcap;
+	}
+	memmove(&row->render[end], &row->render[old_end], row->rsize - old_end + 1);
+	row->rsize = rsize;
+
+	int idx = rx;
+	int j;
+	for (j = at; j < fixed; j++)
+	{
+		if (row->chars[j] == '\t')
+		{
+			row->render[idx++] = ' ';
+			while (idx % KILO_TAB_STOP != 0)
+			{
+				row->render[idx++] = ' ';
+			}
+		}
+		else
+		{
+			row->render[idx++] = row->chars[j];
+		}
+	}
+
+	editorUpdateSyntaxEdit(row, at, n, rx, fixed, delta);
+}
+
+/*
+ * Update a long row after `n` chars were inserted at `at`, or -n chars
+ * deleted there. Only the chunk containing the edit is scanned again.
+ * Later chunks are shifted, and re-highlighted only until the lexer state
+ * matches what they were highlighted with before.
+ */
+void
+editorUpdateChunks(erow *row, int at, int n)
+{
+	int lo = editorRowChunk(row, at);
+	int hi = lo;
+	if (row->size < KILO_CHUNK_SIZE ||
+		(n < 0 && at - n > row->chunks[lo].cx + row->chunks[lo].size))
+	{
+		editorUpdateRow(row);
+		return;
+	}
+
+	int size = row->chunks[lo].size + n;
+	if (size < KILO_CHUNK_SIZE / 4 && row->nchunks > 1)
+	{
+		/* merge a small chunk into its neighbour */
+		if (lo > 0)
+		{
+			lo--;
+		}
+		else
+		{
+			hi++;
+		}
+		size = row->chunks[lo].size + row->chunks[hi].size + n;
+	}
+	int pieces = (size > 2 * KILO_CHUNK_SIZE) ? (size + KILO_CHUNK_SIZE - 1) / KILO_CHUNK_SIZE : 1;
+
+	int old_end = row->chunks[hi].rx + row->chunks[hi].rsize;
+	struct hlstate state = row->chunks[lo].state;
+	editorRechunk(row, lo, hi, pieces, size);
+	row->chunks[lo].state = state;
+
+	/* shift the chunks after the edit */
+	struct rowchunk *last = &row->chunks[lo + pieces - 1];
+	int delta = last->rx + last->rsize - old_end;
+	int relex = lo + pieces - 1;
+	int k;
+	for (k = lo + pieces; k < row->nchunks; k++)
+	{
+		struct rowchunk *ch = &row->chunks[k];
+		ch->cx += n;
+		if (delta == 0)
+		{
+			continue;
+		}
+		if (ch->tabs == 0 || delta % KILO_TAB_STOP == 0)
+		{
+			ch->rx += delta;
+			continue;
+		}
+		/* tab stops moved, widths of this chunk change */
+		int end = ch->rx + ch->rsize;
+		arenaRelease(&E.arena, MEM_RENDER, ch->render, ch->rsize);
+		ch->render = NULL;
+		ch->rx += delta;
+		editorScanChunk(row, ch);
+		delta = ch->rx + ch->rsize - end;
+		relex = k;
+	}
+	last = &row->chunks[row->nchunks - 1];
+	row->rsize = last->rx + last->rsize;
+
+	/* a token at the end of the previous chunk may run into the edit */
+	k = lo;
+	if (k > 0 && at < row->chunks[lo].cx + editorSyntaxLookahead())
+	{
+		k--;
+	}
+	struct hlstate st = row->chunks[k].state;
+	for (; k < row->nchunks; k++)
+	{
+		if (k > relex && editorHlStateEqual(&st, &row->chunks[k].state))
+		{
+			return;
+		}
+		row->chunks[k].state = st;
+		editorHighlightChunk(row, k, &st);
+	}
+	editorSyntaxRowEnd(row, st.in_comment);
+}
+
+void
+editorInsertRow(int at, char *s, size_t len)
+{
+	if (at < 0 || at > E.numrows)
+	{
+		return;
+	}
+
+	if (E.numrows == E.rowcap)
+	{
+		int old = E.rowcap;
+		E.rowcap = (E.rowcap == 0) ? 64 : E.rowcap * 2;
+		E.row = memRealloc(MEM_ROWS, E.row, sizeof(erow) * old,
+			sizeof(erow) * E.rowcap);
+	}
+	memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
+	int j;
+	for (j = at + 1; j <= E.numrows; j++)
+	{
+		E.row[j].idx++;
+	}
+
+	E.row[at].idx = at;
+
+	E.row[at].size = len;
+	E.row[at].cap = len + 1;
+	E.row[at].chars = arenaAlloc(&E.arena, MEM_CHARS, len + 1);
+	memcpy(E.row[at].chars, s, len);
+	E.row[at].chars[len] = '\0';
+	E.row[at].gap = len;
+	E.row[at].gaplen = 0;
+
+	E.row[at].rsize = 0;
+	E.row[at].render = NULL;
+	E.row[at].rcap = 0;
+	E.row[at].hl = NULL;
+	E.row[at].nhl = 0;
+	E.row[at].chunks = NULL;
+	E.row[at].nchunks = 0;
+	E.row[at].hl_open_comment = 0;
+	E.row[at].gen = ++E.gen;
+	E.row[at].orig = -1;
+	E.row[at].origsize = 0;
+	E.row[at].eol = 1;
+	editorUpdateRow(&E.row[at]);
+
+	E.numrows++;
+	E.dirty++;
+	W.stale = 1;
+	editorLineIndexRows(at);
+	editorUndoRecord(UNDO_INSERT_ROW, at, 0, s, len);
+}
+
+void
+editorFreeRow(erow *row)
+{
+	editorFreeChunks(row);
+	arenaRelease(&E.arena, MEM_HL, row->hl, row->nhl * sizeof(hlrun));
+	if (row->render != row->chars)
+	{
+		arenaRelease(&E.arena, MEM_RENDER, row->render, row->rcap);
+	}
+	arenaRelease(&E.arena, MEM_CHARS, row->chars, row->cap);
+}
+
+void
+editorRowReserve(erow *row, int size)
+{
+	if (size > row->cap)
+	{
+		int cap = row->cap * 2;
+		if (cap < size)
+		{
+			cap = size;
+		}
+		int shared = (row->render == row->chars);
+		row->chars = arenaRealloc(&E.arena, MEM_CHARS, row->chars, row->cap, cap);
+		row->cap = cap;
+		if (shared)
+		{
+			row->render = row->chars;
+		}
+	}
+}
+
+void
+editorDelRow(int at)
+{
+	if (at < 0 || at >= E.numrows)
+	{
+		return;
+	}
+	editorRowFlatten(&E.row[at]);
+	editorUndoRecord(UNDO_DELETE_ROW, at, 0, E.row[at].chars, E.row[at].size);
+	editorFreeRow(&E.row[at]);
+	memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
+	int j;
+	for (j = at; j < E.numrows - 1; j++)
+	{
+		E.row[j].idx--;
+	}
+	E.numrows--;
+	E.dirty++;
+	W.stale = 1;
+	editorLineIndexRows(at);
+}
+
+void
+editorRowInsertChar(erow *row, int at, int c)
+{
+	if (at < 0 || at > row->size)
+	{
+		at = row->size;
+	}
+	if (row->nchunks > 0)
+	{
+		editorRowOpenGap(row, at, 1);
+		row->chars[row->gap++] = c;
+		row->gaplen--;
+		row->size++;
+		editorUpdateChunks(row, at, 1);
+	}
+	else
+	{
+		editorRowReserve(row, row->size + 2);
+		memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
+		row->size++;
+		row->chars[at] = c;
+		editorUpdateRowEdit(row, at, 1, c == '\t');
+	}
+	editorWrapRow(row);
+	editorLineIndexEdit(row->idx, 1);
+	row->gen = ++E.gen;
+	E.dirty++;
+	editorUndoRecord(UNDO_INSERT_CHARS, row->idx, at, &row->chars[at], 1);
+}
+
+void
+editorRowInsertString(erow *row, int at, const char *s, size_t len)
+{
+	if (at < 0 || at > row->size)
+	{
+		at = row->size;
+	}
+	if (row->nchunks > 0)
+	{
+		editorRowOpenGap(row, at, len);
+		memcpy(&row->chars[row->gap], s, len);
+		row->gap += len;
+		row->gaplen -= len;
+		row->size += len;
+		editorUpdateChunks(row, at, len);
+	}
+	else
+	{
+		editorRowReserve(row, row->size + len + 1);
+		memmove(&row->chars[at + len], &row->chars[at], row->size - at + 1);
+		memcpy(&row->chars[at], s, len);
+		row->size += len;
+		editorUpdateRowEdit(row, at, len, memchr(s, '\t', len) != NULL);
+	}
+	editorWrapRow(row);
+	editorLineIndexEdit(row->idx, len);
+	row->gen = ++E.gen;
+	E.dirty++;
+	editorUndoRecord(UNDO_INSERT_CHARS, row->idx, at, s, len);
+}
+
+void
+editorRowAppendString(erow *row, char *s, size_t len)
+{
+	editorRowInsertString(row, row->size, s, len);
+}
+
+void
+editorRowDelString(erow *row, int at, int len)
+{
+	if (at < 0 || len <= 0 || at + len > row->size)
+	{
+		return;
+	}
+	if (row->nchunks > 0)
+	{
+		/* the deleted chars join the gap */
+		editorRowMoveGap(row, at);
+		editorUndoRecord(UNDO_DELETE_CHARS, row->idx, at,
+			&row->chars[row->gap + row->gaplen], len);
+		row->gaplen += len;
+		row->size -= len;
+		editorUpdateChunks(row, at, -len);
+	}
+	else
+	{
+		editorUndoRecord(UNDO_DELETE_CHARS, row->idx, at, &row->chars[at], len);
+		int tab = (memchr(&row->chars[at], '\t', len) != NULL);
+		memmove(&row->chars[at], &row->chars[at + len], row->size - at - len + 1);
+		row->size -= len;
+		editorUpdateRowEdit(row, at, -len, tab);
+	}
+	editorWrapRow(row);
+	editorLineIndexEdit(row->idx, -len);
+	row->gen = ++E.gen;
+	E.dirty++;
+}
+
+void
+editorRowDelChar(erow *row, int at)
+{
+	editorRowDelString(row, at, 1);
+}
+
+/*** soft wrap ***/
+
+/* screen lines of a row, the cursor at its end always has a cell */
+long long
+editorWrapLines(erow *row)
+{
+	return row->rsize / W.cols + 1;
+}
+
+void
+editorWrapAdd(int filerow, long long delta)
+{
+	int i;
+	for (i = filerow + 1; i <= W.n; i += i & -i)
+	{
+		W.tree[i] += delta;
+	}
+}
+
+/* screen lines taken up by the rows before `filerow` */
+long long
+editorWrapPrefix(int filerow)
+{
+	long long sum = 0;
+	int i;
+	for (i = filerow; i > 0; i -= i & -i)
+	{
+		sum += W.tree[i];
+	}
+	return sum;
+}
+
+/* rebuild the tree if rows were added or removed or the width changed */
+void
+editorWrapSync(void)
+{
+	if (!W.stale && W.n == E.numrows && W.cols == E.screencols)
+	{
+		return;
+	}
+	if (E.numrows + 1 > W.cap)
+	{
+		int cap = (E.numrows + 1) * 2;
+		W.tree = memRealloc(MEM_ROWS, W.tree, sizeof(long long) * W.cap,
+			sizeof(long long) * cap);
+		W.cap = cap;
+	}
+	W.n = E.numrows;
+	W.cols = E.screencols;
+	W.stale = 0;
+
+	/* each node passes its sum on to its parent, O(n) */
+	int i;
+	for (i = 1; i <= W.n; i++)
+	{
+		W.tree[i] = editorWrapLines(&E.row[i - 1]);
+	}
+	for (i = 1; i <= W.n; i++)
+	{
+		int parent = i + (i & -i);
+		if (parent <= W.n)
+		{
+			W.tree[parent] += W.tree[i];
+		}
+	}
+}
+
+/* a row was edited, update its line count if it changed */
+void
+editorWrapRow(erow *row)
+{
+	if (!W.enabled || W.stale || W.cols != E.screencols || row->idx >= W.n)
+	{
+		return;
+	}
+	long long old = editorWrapPrefix(row->idx + 1) - editorWrapPrefix(row->idx);
+	long long lines = editorWrapLines(row);
+	if (lines != old)
+	{
+		editorWrapAdd(row->idx, lines - old);
+	}
+}
+
+/*
+ * Row that screen line `line` belongs to, and which of its lines it is
+ * in `sub`. Lines past the last row map to E.numrows.
+ */
+int
+editorWrapFind(long long line, long long *sub)
+{
+	int pos = 0;
+	int step = 1;
+	while (step * 2 <= W.n)
+	{
+		step *= 2;
+	}
+	for (; step > 0; step /= 2)
+	{
+		if (pos + step <= W.n && W.tree[pos + step] <= line)
+		{
+			pos += step;
+			line -= W.tree[pos];
+		}
+	}
+	*sub = line;
+	return pos;
+}
+
+/* screen line of the cursor */
+long long
+editorWrapCursor(void)
+{
+	return editorWrapPrefix(E.cy) + E.rx / E.screencols;
+}
+
+/* move the cursor a screen up or down by screen lines */
+void
+editorWrapPage(int key)
+{
+	editorWrapSync();
+	long long target = (key == PAGE_UP) ?
+		E.lineoff - E.screenrows :
+		E.lineoff + 2 * E.screenrows - 1;
+	long long total = editorWrapPrefix(E.numrows);
+	if (target < 0)
+	{
+		target = 0;
+	}
+	if (target > total)
+	{
+		target = total;
+	}
+	long long sub;
+	E.cy = editorWrapFind(target, &sub);
+	E.cx = (E.cy < E.numrows) ?
+		editorRowRxToCx(&E.row[E.cy], sub * E.screencols) : 0;
+}
+
+void
+editorToggleWrap(void)
+{
+	W.enabled = !W.enabled;
+	W.stale = 1;
+	if (W.enabled)
+	{
+		editorWrapSync();
+		E.lineoff = editorWrapPrefix(E.rowoff);
+		E.coloff = 0;
+	}
+	editorSetStatusMessage("Soft wrap %s", W.enabled ? "on" : "off");
+}
+
+/*** line index ***/
+
+void
+editorLineIndexAppend(long long offset)
+{
+	if (L.n == L.cap)
+	{
+		int cap = (L.cap == 0) ? 64 : L.cap * 2;
+		L.offsets = memRealloc(MEM_ROWS, L.offsets, sizeof(long long) * L.cap,
+			sizeof(long long) * cap);
+		L.cap = cap;
+	}
+	L.offsets[L.n++] = offset;
+}
+
+/* the length of a row changed, move the samples after it */
+void
+editorLineIndexEdit(int filerow, long long delta)
+{
+	int k;
+	for (k = filerow / KILO_LINE_INDEX_STEP + 1; k < L.n; k++)
+	{
+		L.offsets[k] += delta;
+	}
+}
+
+/* a row was inserted or deleted at `at`, later samples name other rows */
+void
+editorLineIndexRows(int at)
+{
+	int keep = at / KILO_LINE_INDEX_STEP + 1;
+	if (L.n > keep)
+	{
+		L.n = keep;
+	}
+}
+
+/* take samples again up to the one before `filerow` */
+void
+editorLineIndexExtend(int filerow)
+{
+	if (L.n == 0)
+	{
+		editorLineIndexAppend(0);
+	}
+	while (L.n * KILO_LINE_INDEX_STEP <= filerow)
+	{
+		int j = (L.n - 1) * KILO_LINE_INDEX_STEP;
+		long long offset = L.offsets[L.n - 1];
+		for (; j < L.n * KILO_LINE_INDEX_STEP; j++)
+		{
+			offset += E.row[j].size + E.row[j].eol;
+		}
+		editorLineIndexAppend(offset);
+	}
+}
+
+/* byte offset where `filerow` starts */
+long long
+editorRowOffset(int filerow)
+{
+	editorLineIndexExtend(filerow);
+	int j = filerow / KILO_LINE_INDEX_STEP * KILO_LINE_INDEX_STEP;
+	long long offset = L.offsets[filerow / KILO_LINE_INDEX_STEP];
+	for (; j < filerow; j++)
+	{
+		offset += E.row[j].size + E.row[j].eol;
+	}
+	return offset;
+}
+
+/*
+ * Row holding byte `offset`, and the index of the byte within it in `at`.
+ * Offsets past the end give the last row.
+ */
+int
+editorOffsetRow(long long offset, int *at)
+{
+	*at = 0;
+	if (E.numrows == 0)
+	{
+		return 0;
+	}
+	editorLineIndexExtend(E.numrows - 1);
+
+	/* last sample at or before the offset */
+	int lo = 0;
+	int hi = L.n - 1;
+	while (lo < hi)
+	{
+		int mid = (lo + hi + 1) / 2;
+		if (L.offsets[mid] <= offset)
+		{
+			lo = mid;
+		}
+		else
+		{
+			hi = mid - 1;
+		}
+	}
+
+	int filerow = lo * KILO_LINE_INDEX_STEP;
+	offset -= L.offsets[lo];
+	while (filerow < E.numrows - 1 &&
+		offset >= E.row[filerow].size + E.row[filerow].eol)
+	{
+		offset -= E.row[filerow].size + E.row[filerow].eol;
+		filerow++;
+	}
+	*at = (offset < E.row[filerow].size) ? offset : E.row[filerow].size;
+	return filerow;
+}
+
+/*
+ * Move the cursor to a line number counted from 1, or to a byte offset
+ * counted from 0 when `target` starts with '@'. The row is shown at the
+ * top of the screen.
+ */
+int
+editorGotoTarget(const char *target)
+{
+	char *end;
+	int offset = (target[0] == '@');
+	long long n = strtoll(&target[offset], &end, 10);
+	if (end == &target[offset] || *end != '\0' || n < 0)
+	{
+		return -1;
+	}
+
+	if (V.active)
+	{
+		/* the pager only knows the rows in its window */
+		editorPagerSeek(offset ? n : editorPagerLineOffset(n));
+		return 0;
+	}
+	if (offset)
+	{
+		E.cy = editorOffsetRow(n, &E.cx);
+	}
+	else
+	{
+		E.cy = (n < 1) ? 0 : (n > E.numrows) ? E.numrows : n - 1;
+		E.cx = 0;
+	}
+	E.rowoff = E.numrows;
+	E.lineoff = (long long)1 << 62;
+	return 0;
+}
+
+void
+editorGoto(void)
+{
+	char *target = editorPrompt("Go to: %s (line, @offset or ESC)", NULL);
+	if (target == NULL)
+	{
+		return;
+	}
+	if (editorGotoTarget(target) == -1)
+	{
+		editorSetStatusMessage("Not a line or offset: %s", target);
+	}
+	memFree(MEM_OTHER, target, strlen(target) + 1);
+}
+
+/*** undo ***/
+
+struct undoRecord
+{
+	unsigned char type;
+	/* text of UNDO_DELETE_CHARS is stored last char first */
+	unsigned char reversed;
+	int group;
+	int row;
+	int at;
+	int len;
+};
+
+#define UNDO_NONE (-1)
+
+/* size of a record including its text and trailing size */
+#define UNDO_RECORD_SIZE(len) (sizeof(struct undoRecord) + (len) + sizeof(int))
+
+void
+editorUndoReset(void)
+{
+	memFree(MEM_UNDO, E.undo.buf, E.undo.cap);
+	E.undo.buf = NULL;
+	E.undo.len = 0;
+	E.undo.cap = 0;
+	E.undo.pos = 0;
+	E.undo.last = UNDO_NONE;
+	E.undo.group = 0;
+	E.undo.kind = UNDO_KIND_NONE;
+	E.undo.dropped = UNDO_NONE;
+}
+
+/*
+ * Records are not aligned inside the journal, so they are always
+ * copied in and out with memcpy.
+ */
+void
+editorUndoGet(size_t off, struct undoRecord *rec)
+{
+	memcpy(rec, &E.undo.buf[off], sizeof(struct undoRecord));
+}
+
+void
+editorUndoPut(size_t off, const struct undoRecord *rec)
+{
+	memcpy(&E.undo.buf[off], rec, sizeof(struct undoRecord));
+	int size = UNDO_RECORD_SIZE(rec->len);
+	memcpy(&E.undo.buf[off + size - sizeof(int)], &size, sizeof(int));
+}
+
+/* offset of the record that ends at `end` */
+size_t
+editorUndoPrev(size_t end)
+{
+	int size;
+	memcpy(&size, &E.undo.buf[end - sizeof(int)], sizeof(int));
+	return end - size;
+}
+
+void
+editorUndoReserve(size_t extra)
+{
+	if (E.undo.len + extra > E.undo.cap)
+	{
+		size_t cap = (E.undo.cap == 0) ? 4096 : E.undo.cap;
+		while (cap < E.undo.len + extra)
+		{
+			cap *= 2;
+		}
+		E.undo.buf = memRealloc(MEM_UNDO, E.undo.buf, E.undo.cap, cap);
+		E.undo.cap = cap;
+	}
+}
+
+/*
+ * Drop the oldest groups of edits until the journal is well below its
+ * limit again, so the memmove is only paid once in a while. The newest
+ * group is still being recorded and is never cut into: when it alone is
+ * over the limit, the whole history goes and the group is not recorded
+ * any further, so it is never partly undone.
+ */
+void
+editorUndoTrim(void)
+{
+	if (E.undo.len <= E.undo.limit)
+	{
+		return;
+	}
+	size_t newest = E.undo.len;
+	while (newest > 0)
+	{
+		struct undoRecord rec;
+		size_t off = editorUndoPrev(newest);
+		editorUndoGet(off, &rec);
+		if (rec.group != E.undo.group)
+		{
+			break;
+		}
+		newest = off;
+	}
+	if (newest == 0)
+	{
+		E.undo.len = 0;
+		E.undo.pos = 0;
+		E.undo.last = UNDO_NONE;
+		E.undo.dropped = E.undo.group;
+		return;
+	}
+
+	size_t target = E.undo.len - E.undo.limit * 3 / 4;
+	size_t cut = 0;
+	while (cut < newest)
+	{
+		struct undoRecord rec;
+		editorUndoGet(cut, &rec);
+		cut += UNDO_RECORD_SIZE(rec.len);
+		if (cut >= target && cut < newest)
+		{
+			struct undoRecord next;
+			editorUndoGet(cut, &next);
+			if (next.group != rec.group)
+			{
+				break;
+			}
+		}
+	}
+
+	memmove(E.undo.buf, &E.undo.buf[cut], E.undo.len - cut);
+	E.undo.len -= cut;
+	E.undo.pos = (E.undo.pos > cut) ? E.undo.pos - cut : 0;
+	if (E.undo.last != UNDO_NONE)
+	{
+		E.undo.last = ((size_t)E.undo.last >= cut) ? E.undo.last - (long)cut : UNDO_NONE;
+	}
+}
+
+/*
+ * Record a row operation. Runs of typed or deleted characters are merged
+ * into the previous record, so sustained typing costs one byte per key.
+ */
+void
+editorUndoRecord(int type, int row, int at, const char *s, int len)
+{
+	if (E.undo.suspended)
+	{
+		return;
+	}
+
+	/* a new edit makes everything that was undone unreachable */
+	E.undo.len = E.undo.pos;
+	if (E.undo.last != UNDO_NONE && (size_t)E.undo.last >= E.undo.len)
+	{
+		E.undo.last = UNDO_NONE;
+	}
+	if (E.undo.group == E.undo.dropped)
+	{
+		return;
+	}
+
+	if (E.undo.last != UNDO_NONE && len == 1)
+	{
+		struct undoRecord rec;
+		editorUndoGet(E.undo.last, &rec);
+		int merge = 0;
+		if (rec.group == E.undo.group && rec.type == type && rec.row == row)
+		{
+			if (type == UNDO_INSERT_CHARS && rec.at + rec.len == at)
+			{
+				merge = 1;
+			}
+			else if (type == UNDO_DELETE_CHARS && !rec.reversed && rec.at == at)
+			{
+				/* delete key */
+				merge = 1;
+			}
+			else if (type == UNDO_DELETE_CHARS && (rec.reversed || rec.len == 1) &&
+				rec.at == at + 1)
+			{
+				/* backspace */
+				rec.reversed = 1;
+				rec.at = at;
+				merge = 1;
+			}
+		}
+		if (merge)
+		{
+			editorUndoReserve(1);
+			size_t text_end = E.undo.last + sizeof(struct undoRecord) + rec.len;
+			E.undo.buf[text_end] = s[0];
+			rec.len++;
+			editorUndoPut(E.undo.last, &rec);
+			E.undo.len++;
+			E.undo.pos = E.undo.len;
+			return;
+		}
+	}
+
+	struct undoRecord rec;
+	rec.type = type;
+	rec.reversed = 0;
+	rec.group = E.undo.group;
+	rec.row = row;
+	rec.at = at;
+	rec.len = len;
+	editorUndoReserve(UNDO_RECORD_SIZE(len));
+	memcpy(&E.undo.buf[E.undo.len + sizeof(struct undoRecord)], s, len);
+	editorUndoPut(E.undo.len, &rec);
+	E.undo.last = (type == UNDO_INSERT_CHARS || type == UNDO_DELETE_CHARS) ?
+		(long)E.undo.len : UNDO_NONE;
+	E.undo.len += UNDO_RECORD_SIZE(len);
+	E.undo.pos = E.undo.len;
+
+	editorUndoTrim();
+}
+
+/*
+ * Called before a key edits the text. Consecutive keys of the same kind,
+ * such as typing or pasting text, are undone as a single step.
+ */
+void
+editorUndoBegin(int kind)
+{
+	if (kind != E.undo.kind || E.undo.lastkey + 1 != E.undo.keys)
+	{
+		E.undo.group++;
+		E.undo.last = UNDO_NONE;
+	}
+	E.undo.kind = kind;
+	E.undo.lastkey = E.undo.keys;
+}
+
+void
+editorUndoApply(const struct undoRecord *rec, const char *text, int redo)
+{
+	int type = rec->type;
+	if (redo == 0)
+	{
+		/* undo by applying the opposite operation */
+		switch (type)
+		{
+		case UNDO_INSERT_CHARS:
+			type = UNDO_DELETE_CHARS;
+			break;
+		case UNDO_DELETE_CHARS:
+			type = UNDO_INSERT_CHARS;
+			break;
+		case UNDO_INSERT_ROW:
+			type = UNDO_DELETE_ROW;
+			break;
+		case UNDO_DELETE_ROW:
+			type = UNDO_INSERT_ROW;
+			break;
+		}
+	}
+
+	switch (type)
+	{
+	case UNDO_INSERT_CHARS:
+		if (rec->reversed)
+		{
+			char *s = memAlloc(MEM_UNDO, rec->len);
+			int j;
+			for (j = 0; j < rec->len; j++)
+			{
+				s[j] = text[rec->len - 1 - j];
+			}
+			editorRowInsertString(&E.row[rec->row], rec->at, s, rec->len);
+			memFree(MEM_UNDO, s, rec->len);
+		}
+		else
+		{
+			editorRowInsertString(&E.row[rec->row], rec->at, text, rec->len);
+		}
+		break;
+	case UNDO_DELETE_CHARS:
+		editorRowDelString(&E.row[rec->row], rec->at, rec->len);
+		break;
+	case UNDO_INSERT_ROW:
+		editorInsertRow(rec->row, (char *)text, rec->len);
+		break;
+	case UNDO_DELETE_ROW:
+		editorDelRow(rec->row);
+		break;
+	}
+
+	E.cy = rec->row;
+	E.cx = rec->at;
+	if (type == UNDO_INSERT_CHARS && redo)
+	{
+		E.cx += rec->len;
+	}
+}
+
+void
+editorUndo(void)
+{
+	if (E.undo.pos == 0)
+	{
+		editorSetStatusMessage("Nothing to undo");
+		return;
+	}
+
+	struct undoRecord rec;
+	editorUndoGet(editorUndoPrev(E.undo.pos), &rec);
+	int group = rec.group;
+
+	E.undo.suspended++;
+	while (E.undo.pos > 0)
+	{
+		size_t off = editorUndoPrev(E.undo.pos);
+		editorUndoGet(off, &rec);
+		if (rec.group != group)
+		{
+			break;
+		}
+		editorUndoApply(&rec, &E.undo.buf[off + sizeof(struct undoRecord)], 0);
+		E.undo.pos = off;
+	}
+	E.undo.suspended--;
+	E.undo.last = UNDO_NONE;
+	E.undo.kind = UNDO_KIND_NONE;
+}
+
+void
+editorRedo(void)
+{
+	if (E.undo.pos == E.undo.len)
+	{
+		editorSetStatusMessage("Nothing to redo");
+		return;
+	}
+
+	struct undoRecord rec;
+	editorUndoGet(E.undo.pos, &rec);
+	int group = rec.group;
+
+	E.undo.suspended++;
+	while (E.undo.pos < E.undo.len)
+	{
+		editorUndoGet(E.undo.pos, &rec);
+		if (rec.group != group)
+		{
+			break;
+		}
+		editorUndoApply(&rec, &E.undo.buf[E.undo.pos + sizeof(struct undoRecord)], 1);
+		E.undo.pos += UNDO_RECORD_SIZE(rec.len);
+	}
+	E.undo.suspended--;
+	E.undo.last = UNDO_NONE;
+	E.undo.kind = UNDO_KIND_NONE;
+}
+
+/*** editor operations ***/
+
+void
+editorInsertChar(int c)
+{
+	if (E.cy == E.numrows)
+	{
+		/* add empty line to end of file */
+		editorInsertRow(E.numrows, "", 0);
+	}
+	editorRowInsertChar(&E.row[E.cy], E.cx, c);
+	E.cx++;
+}
+
+void
+editorInsertNewline(void)
+{
+	if (E.cx == 0)
+	{
+		editorInsertRow(E.cy, "", 0);
+	}
+	else
+	{
+		erow *row = &E.row[E.cy];
+		editorRowFlatten(row);
+		editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
+		row = &E.row[E.cy];
+		editorRowDelString(row, E.cx, row->size - E.cx);
+	}
+	E.cy++;
+	E.cx = 0;
+}
+
+void
+editorDelChar(void)
+{
+	if (E.cy == E.numrows)
+	{
+		return;
+	}
+	if (E.cx == 0 && E.cy == 0)
+	{
+		return;
+	}
+
+	erow *row = &E.row[E.cy];
+	if (E.cx > 0)
+	{
+		editorRowDelChar(row, E.cx - 1);
+		E.cx--;
+	}
+	else
+	{
+		E.cx = E.row[E.cy - 1].size;
+		editorRowFlatten(row);
+		editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
+		editorDelRow(E.cy);
+		E.cy--;
+	}
+}
+
+/*** file i/o ***/
+
+char *
+editorRowsToString(size_t *buflen)
+{
+	int totlen = 0;
+	int j;
+	for (j = 0; j < E.numrows; j++)
+	{
+		totlen += E.row[j].size + 1;
+	}
+	*buflen = totlen;
+
+	char *buf = memAlloc(MEM_OTHER, totlen);
+	char *p = buf;
+	for (j = 0; j < E.numrows; j++)
+	{
+		editorRowFlatten(&E.row[j]);
+		memcpy(p, E.row[j].chars, E.row[j].size);
+		p += E.row[j].size;
+		*p = '\n';
+		p++;
+	}
+	return buf;
+}
+
+#ifndef _WIN32
+/* the tool that decompresses the file, from its first bytes */
+const char *
+editorCompression(int fd)
+{
+	unsigned char magic[4];
+	if (pread(fd, magic, sizeof(magic), 0) != sizeof(magic))
+	{
+		return NULL;
+	}
+	if (magic[0] == 0x1f && magic[1] == 0x8b)
+	{
+		return "gzip";
+	}
+	if (magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd)
+	{
+		return "zstd";
+	}
+	return NULL;
+}
+
+/* a pipe whose ends are not passed on to the tools run */
+void
+editorPipe(int fd[2])
+{
+	if (pipe(fd) == -1)
+	{
+		die("pipe");
+	}
+	fcntl(fd[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fd[1], F_SETFD, FD_CLOEXEC);
+}
+
+/* run E.compress from `in` to `out`, compressing or decompressing */
+pid_t
+editorSpawn(int decompress, int in, int out)
+{
+	pid_t pid = fork();
+	if (pid == -1)
+	{
+		die("fork");
+	}
+	if (pid == 0)
+	{
+		/* the terminal is the editor's, messages would garble it */
+		int null = open("/dev/null", O_WRONLY | O_CLOEXEC);
+		dup2(in, STDIN_FILENO);
+		dup2(out, STDOUT_FILENO);
+		dup2(null, STDERR_FILENO);
+		if (decompress)
+		{
+			execlp(E.compress, E.compress, "-d", "-c", "-q", (char *)NULL);
+		}
+		else
+		{
+			execlp(E.compress, E.compress, "-c", "-q", (char *)NULL);
+		}
+		_exit(127);
+	}
+	return pid;
+}
+
+/*
+ * Write the rows through the tool the file was read with, one row at a
+ * time so that no copy of the whole text is made. The output goes to a
+ * file next to it, renamed over it only once the tool succeeded.
+ */
+int
+editorSaveCompressed(long long *written)
+{
+	size_t tmplen = strlen(E.filename) + 8;
+	char *tmp = memAlloc(MEM_OTHER, tmplen);
+	snprintf(tmp, tmplen, "%s.XXXXXX", E.filename);
+	int fd = mkstemp(tmp);
+	if (fd == -1)
+	{
+		memFree(MEM_OTHER, tmp, tmplen);
+		return -1;
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	struct stat st;
+	if (fchmod(fd, (stat(E.filename, &st) == 0) ? (st.st_mode & 07777) : 0644) == -1)
+	{
+		/* the file keeps working, only its permissions differ */
+	}
+	int p[2];
+	editorPipe(p);
+	pid_t pid = editorSpawn(0, p[0], fd);
+	close(p[0]);
+
+	/* a compressor that died is seen in its exit status */
+	void (*sigpipe)(int) = signal(SIGPIPE, SIG_IGN);
+	FILE *fp = fdopen(p[1], "w");
+	int ok = (fp != NULL);
+	int j;
+	for (j = 0; ok && j < E.numrows; j++)
+	{
+		erow *row = &E.row[j];
+		editorRowFlatten(row);
+		ok = (fwrite(row->chars, 1, row->size, fp) == (size_t)row->size &&
+			putc('\n', fp) != EOF);
+		*written += row->size + 1;
+	}
+	if (fp != NULL)
+	{
+		ok = (fclose(fp) == 0) && ok;
+	}
+	else
+	{
+		close(p[1]);
+	}
+
+	signal(SIGPIPE, sigpipe);
+
+	int status;
+	ok = (waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+		WEXITSTATUS(status) == 0) && ok;
+	ok = (close(fd) == 0) && ok;
+	ok = ok && rename(tmp, E.filename) == 0;
+	if (!ok)
+	{
+		unlink(tmp);
+	}
+	memFree(MEM_OTHER, tmp, tmplen);
+	return ok ? 0 : -1;
+}
+
+/* last modification time of a file in nanoseconds */
+long long
+editorDiskTime(struct stat *st)
+{
+#ifdef __APPLE__
+	return (long long)st->st_mtimespec.tv_sec * 1000000000 + st->st_mtimespec.tv_nsec;
+#else
+	return (long long)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+#endif
+}
+
+/* remember the file as it is on disk now */
+void
+editorDiskRecord(struct stat *st)
+{
+	E.diskdev = st->st_dev;
+	E.diskino = st->st_ino;
+	E.disksize = st->st_size;
+	E.diskmtime = editorDiskTime(st);
+}
+
+/* is `fd` still the file as it was read or last saved? */
+int
+editorDiskSame(int fd)
+{
+	struct stat st;
+	return (fstat(fd, &st) == 0 && (long long)st.st_dev == E.diskdev &&
+		(long long)st.st_ino == E.diskino && st.st_size == E.disksize &&
+		editorDiskTime(&st) == E.diskmtime);
+}
+
+int
+editorPwrite(int fd, const char *s, size_t len, long long offset)
+{
+	size_t done = 0;
+	while (done < len)
+	{
+		ssize_t n = pwrite(fd, &s[done], len - done, offset + done);
+		if (n == -1 && errno != EINTR)
+		{
+			return -1;
+		}
+		done += (n > 0) ? n : 0;
+	}
+	return 0;
+}
+
+/*
+ * Write only what changed since the file was read or saved. Edited rows
+ * that still fit where the file has them are written over in place.
+ * Everything from the first row that moved is written again after the
+ * rows before it, or the whole file when `whole` is set. Returns the
+ * bytes written, or -1.
+ */
+long long
+editorSaveInPlace(int fd, int whole)
+{
+	long long pos = 0;
+	long long written = 0;
+	int j;
+	for (j = 0; j < E.numrows; j++)
+	{
+		erow *row = &E.row[j];
+		if (whole || row->orig != pos || row->origsize != row->size)
+		{
+			break;
+		}
+		if (row->gen > E.savedgen)
+		{
+			editorRowFlatten(row);
+			if (editorPwrite(fd, row->chars, row->size, pos) == -1)
+			{
+				return -1;
+			}
+			written += row->size;
+		}
+		pos += row->size + 1;
+	}
+
+	char *buf = memAlloc(MEM_OTHER, KILO_SAVE_BLOCK);
+	int len = 0;
+	int ok = 1;
+	for (; ok && j < E.numrows; j++)
+	{
+		erow *row = &E.row[j];
+		editorRowFlatten(row);
+		if (len + row->size + 1 > KILO_SAVE_BLOCK)
+		{
+			ok = (editorPwrite(fd, buf, len, pos) == 0);
+			pos += len;
+			written += len;
+			len = 0;
+		}
+		if (row->size + 1 > KILO_SAVE_BLOCK)
+		{
+			/* too long for the buffer, write it on its own */
+			ok = ok && editorPwrite(fd, row->chars, row->size, pos) == 0 &&
+				editorPwrite(fd, "\n", 1, pos + row->size) == 0;
+			pos += row->size + 1;
+			written += row->size + 1;
+			continue;
+		}
+		memcpy(&buf[len], row->chars, row->size);
+		buf[len + row->size] = '\n';
+		len += row->size + 1;
+	}
+	ok = ok && editorPwrite(fd, buf, len, pos) == 0;
+	pos += len;
+	written += len;
+	memFree(MEM_OTHER, buf, KILO_SAVE_BLOCK);
+
+	/* the file may have been longer */
+	if (!ok || ftruncate(fd, pos) == -1)
+	{
+		return -1;
+	}
+	return written;
+}
+#endif
+
+/* every row is now where the saved file has it */
+void
+editorSaveDone(void)
+{
+	long long pos = 0;
+	int j;
+	for (j = 0; j < E.numrows; j++)
+	{
+		E.row[j].orig = pos;
+		E.row[j].origsize = E.row[j].size;
+		E.row[j].eol = 1;
+		pos += E.row[j].size + 1;
+	}
+	/* the file now ends every row in a newline */
+	editorLineIndexRows(0);
+	E.savedgen = E.gen;
+	E.dirty = 0;
+#ifndef _WIN32
+	struct stat st;
+	if (stat(E.filename, &st) == 0)
+	{
+		editorDiskRecord(&st);
+	}
+#endif
+}
+
+void
+editorOpen(char *filename)
+{
+	if (E.filename != NULL)
+	{
+		memFree(MEM_OTHER, E.filename, strlen(E.filename) + 1);
+	}
+	E.filename = memStrdup(MEM_OTHER, filename);
+
+	editorSelectSyntaxHighlight();
+
+	traceBegin("editorOpen");
+	FILE *fp = fopen(filename, "r");
+	if (!fp)
+	{
+		die("fopen");
+	}
+#ifndef _WIN32
+	fcntl(fileno(fp), F_SETFD, FD_CLOEXEC);
+	E.compress = editorCompression(fileno(fp));
+	if (E.compress != NULL)
+	{
+		/* the text streams in from the decompressor like standard input */
+		int p[2];
+		editorPipe(p);
+		D.pid = editorSpawn(1, fileno(fp), p[1]);
+		close(p[1]);
+		fclose(fp);
+		editorStreamInit(p[0]);
+		traceEnd("editorOpen");
+		return;
+	}
+#endif
+
+	char *line = NULL;
+	size_t linecap = 0;
+	ssize_t linelen;
+	long long fileoff = 0;
+	editorUndoReset();
+	E.undo.suspended++;
+	L.n = 0;
+	while ((linelen = getline(&line, &linecap, fp)) != -1)
+	{
+		ssize_t raw = linelen;
+		while (linelen > 0 &&
+			(line[linelen - 1] == '\r' || line[linelen - 1] == '\n'))
+		{
+			linelen--;
+		}
+
+		if (E.numrows % KILO_LINE_INDEX_STEP == 0)
+		{
+			editorLineIndexAppend(fileoff);
+		}
+		editorInsertRow(E.numrows, line, linelen);
+		/* only rows saved the way they were read can be written in place */
+		erow *row = &E.row[E.numrows - 1];
+		row->orig = (raw == linelen + 1 && line[linelen] == '\n') ? fileoff : -1;
+		row->origsize = linelen;
+		row->eol = raw - linelen;
+		fileoff += raw;
+	}
+	free(line);
+#ifndef _WIN32
+	struct stat st;
+	if (fstat(fileno(fp), &st) == 0)
+	{
+		editorDiskRecord(&st);
+	}
+#endif
+	fclose(fp);
+	E.undo.suspended--;
+	E.dirty = 0;
+	E.savedgen = E.gen;
+	traceEndArg("editorOpen", "rows", E.numrows);
+}
+
+void
+editorSave(void)
+{
+	int is_new_file = 0;
+
+	if (D.active)
+	{
+		editorSetStatusMessage("Cannot save before the whole file is read");
+		return;
+	}
+	if (E.filename == NULL)
+	{
+		E.filename = editorPrompt("Save as: %s (ESC or Ctrl-Q to cancel)", NULL);
+		if (E.filename == NULL)
+		{
+			editorSetStatusMessage("Save aborted");
+			return;
+		}
+		editorSelectSyntaxHighlight();
+		is_new_file = 1;
+	}
+
+	traceBegin("editorSave");
+#ifndef _WIN32
+	if (E.compress != NULL)
+	{
+		long long written = 0;
+		if (editorSaveCompressed(&written) == 0)
+		{
+			E.dirty = 0;
+			editorSetStatusMessage("%lld bytes compressed with %s and written to disk",
+				written, E.compress);
+			traceEndArg("editorSave", "bytes", written);
+			return;
+		}
+		editorSetStatusMessage("Cannot save! %s failed", E.compress);
+		traceEndArg("editorSave", "bytes", 0);
+		return;
+	}
+
+	int fd = is_new_file ? -1 : open(E.filename, O_WRONLY);
+	if (fd != -1)
+	{
+		/* rewrite all of it if someone else changed the file meanwhile */
+		long long written = editorSaveInPlace(fd, !editorDiskSame(fd));
+		if (close(fd) == 0 && written != -1)
+		{
+			editorSaveDone();
+			editorSetStatusMessage("%lld bytes written to disk", written);
+			traceEndArg("editorSave", "bytes", written);
+			return;
+		}
+		editorSetStatusMessage("Cannot save! I/O error: %s", strerror(errno));
+		traceEndArg("editorSave", "bytes", 0);
+		return;
+	}
+#endif
+	size_t len;
+	char *buf = editorRowsToString(&len);
+
+	FILE *fp = fopen(E.filename, (is_new_file ? "wx" : "w"));
+	if (fp)
+	{
+		if (fwrite(buf, 1, len, fp) == len)
+		{
+			fclose(fp);
+			memFree(MEM_OTHER, buf, len);
+			editorSaveDone();
+			editorSetStatusMessage("%d bytes written to disk", len);
+			traceEndArg("editorSave", "bytes", len);
+			return;
+		}
+		fclose(fp);
+	}
+	editorSetStatusMessage("Cannot save! I/O error: %s", strerror(errno));
+	memFree(MEM_OTHER, buf, len);
+	traceEndArg("editorSave", "bytes", 0);
+
+	if (is_new_file)
+	{
+		memFree(MEM_OTHER, E.filename, strlen(E.filename) + 1);
+		E.filename = NULL;
+	}
+}
+
+/*** find ***/
+
+#define KILO_FIND_HISTORY 16
+/* most matches kept of a query, more are found row by row when needed */
+#define KILO_FIND_MATCHES 65536
+
+struct findMatch
+{
+	/* row number in file, zero-based */
+	int row;
+	/* index into erow.chars */
+	int off;
+};
+
+/* render columns of a search match */
+struct matchRange
+{
+	int start;
+	int end;
+};
+
+/*
+ * All matches of the query truncated to `querylen` chars. Every match of
+ * a query is also a match of each of its prefixes, so a longer query only
+ * has to filter the level below it instead of scanning the whole file.
+ */
+struct findLevel
+{
+	int querylen;
+	int nmatches;
+	/* allocated entries of matches */
+	int cap;
+	struct findMatch *matches;
+	/* more than KILO_FIND_MATCHES, only nmatches counts them */
+	int lazy;
+};
+
+struct findState
+{
+	/* query of the top level, lower levels use a prefix of it */
+	char *query;
+	/* history stack, top level holds matches for the current query */
+	struct findLevel levels[KILO_FIND_HISTORY];
+	int depth;
+	/* index of selected match in top level */
+	int current;
+	/* selected match when the top level is lazy */
+	struct findMatch match;
+};
+struct findState F;
+
+void
+editorFindPopLevel(void)
+{
+	F.depth--;
+	memFree(MEM_SEARCH, F.levels[F.depth].matches,
+		sizeof(struct findMatch) * F.levels[F.depth].cap);
+	F.levels[F.depth].matches = NULL;
+}
+
+void
+editorFindReset(void)
+{
+	while (F.depth > 0)
+	{
+		editorFindPopLevel();
+	}
+	if (F.query != NULL)
+	{
+		memFree(MEM_SEARCH, F.query, strlen(F.query) + 1);
+	}
+	F.query = NULL;
+	F.current = 0;
+}
+
+struct findLevel *
+editorFindPushLevel(int querylen)
+{
+	if (F.depth == KILO_FIND_HISTORY)
+	{
+		/* history is full, forget the shortest query */
+		memFree(MEM_SEARCH, F.levels[0].matches,
+			sizeof(struct findMatch) * F.levels[0].cap);
+		memmove(&F.levels[0], &F.levels[1],
+			sizeof(struct findLevel) * (KILO_FIND_HISTORY - 1));
+		F.depth--;
+	}
+	struct findLevel *level = &F.levels[F.depth++];
+	level->querylen = querylen;
+	level->nmatches = 0;
+	level->cap = 0;
+	level->matches = NULL;
+	level->lazy = 0;
+	return level;
+}
+
+void
+editorFindAddMatch(struct findLevel *level, int row, int off)
+{
+	if (level->nmatches == level->cap)
+	{
+		int old = level->cap;
+		level->cap = (level->cap == 0) ? 64 : level->cap * 2;
+		level->matches = memRealloc(MEM_SEARCH, level->matches,
+			sizeof(struct findMatch) * old, sizeof(struct findMatch) * level->cap);
+	}
+	level->matches[level->nmatches].row = row;
+	level->matches[level->nmatches].off = off;
+	level->nmatches++;
+}
+
+void
+editorFindUpdate(char *query)
+{
+	int len = strlen(query);
+
+	/* backspace, drop levels for queries that are no longer a prefix */
+	while (F.depth > 0)
+	{
+		struct findLevel *top = &F.levels[F.depth - 1];
+		if (top->querylen <= len && strncmp(F.query, query, top->querylen) == 0)
+		{
+			break;
+		}
+		editorFindPopLevel();
+	}
+
+	if (F.query != NULL)
+	{
+		memFree(MEM_SEARCH, F.query, strlen(F.query) + 1);
+	}
+	F.query = memStrdup(MEM_SEARCH, query);
+	F.current = 0;
+
+	if (len == 0)
+	{
+		return;
+	}
+	if (F.depth > 0 && F.levels[F.depth - 1].querylen == len)
+	{
+		return;
+	}
+
+	if (F.depth > 0 && !F.levels[F.depth - 1].lazy)
+	{
+		/* query was extended, narrow down matches of its prefix */
+		struct findLevel prev = F.levels[F.depth - 1];
+		struct findLevel *level = editorFindPushLevel(len);
+		int j;
+		for (j = 0; j < prev.nmatches; j++)
+		{
+			erow *row = &E.row[prev.matches[j].row];
+			int off = prev.matches[j].off;
+			if (off + len <= row->size &&
+				memcmp(&row->chars[off], query, len) == 0)
+			{
+				editorFindAddMatch(level, prev.matches[j].row, off);
+			}
+		}
+	}
+	else
+	{
+		struct findLevel *level = editorFindPushLevel(len);
+		int filerow;
+		for (filerow = 0; filerow < E.numrows; filerow++)
+		{
+			erow *row = &E.row[filerow];
+			editorRowFlatten(row);
+			char *match = row->chars;
+			while ((match = strstr(match, query)) != NULL)
+			{
+				if (!level->lazy && level->nmatches == KILO_FIND_MATCHES)
+				{
+					/* too many to keep, only count the rest */
+					memFree(MEM_SEARCH, level->matches,
+						sizeof(struct findMatch) * level->cap);
+					level->matches = NULL;
+					level->cap = 0;
+					level->lazy = 1;
+				}
+				if (level->lazy)
+				{
+					level->nmatches++;
+				}
+				else
+				{
+					editorFindAddMatch(level, filerow, match - row->chars);
+				}
+				/* matches may overlap */
+				match++;
+			}
+		}
+	}
+}
+
+/*
+ * Matches of the current search on `filerow`, drawn as an overlay on top
+ * of the syntax highlighting. Matches are sorted by row and offset.
+ */
+struct findMatch *
+editorFindRowMatches(int filerow, int *count)
+{
+	*count = 0;
+	if (F.depth == 0)
+	{
+		return NULL;
+	}
+	struct findLevel *level = &F.levels[F.depth - 1];
+	if (level->lazy)
+	{
+		/* find them on the row instead */
+		static struct findMatch *buf = NULL;
+		static int cap = 0;
+		erow *row = &E.row[filerow];
+		editorRowFlatten(row);
+		char *match = row->chars;
+		while ((match = strstr(match, F.query)) != NULL)
+		{
+			if (*count == cap)
+			{
+				int old = cap;
+				cap = (cap == 0) ? 16 : cap * 2;
+				buf = memRealloc(MEM_SEARCH, buf, sizeof(struct findMatch) * old,
+					sizeof(struct findMatch) * cap);
+			}
+			buf[*count].row = filerow;
+			buf[*count].off = match - row->chars;
+			(*count)++;
+			match++;
+		}
+		return buf;
+	}
+
+	int lo = 0;
+	int hi = level->nmatches;
+	while (lo < hi)
+	{
+		int mid = lo + (hi - lo) / 2;
+		if (level->matches[mid].row < filerow)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+
+	int end = lo;
+	while (end < level->nmatches && level->matches[end].row == filerow)
+	{
+		end++;
+	}
+	*count = end - lo;
+	return &level->matches[lo];
+}
+
+/*
+ * Render columns of the matches on a row that overlap columns `from` to
+ * `to`, drawn by editorDrawRows on top of the syntax highlighting.
+ */
+int
+editorFindRowRanges(erow *row, int from, int to, struct matchRange **ranges)
+{
+	static struct matchRange *buf = NULL;
+	static int cap = 0;
+
+	int nmatches;
+	struct findMatch *match = editorFindRowMatches(row->idx, &nmatches);
+	if (nmatches == 0)
+	{
+		return 0;
+	}
+	int querylen = F.levels[F.depth - 1].querylen;
+
+	/* skip matches left of the screen */
+	int cx = editorRowRxToCx(row, from) - querylen;
+	int lo = 0;
+	int hi = nmatches;
+	while (lo < hi)
+	{
+		int mid = lo + (hi - lo) / 2;
+		if (match[mid].off < cx)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+
+	int n = 0;
+	int j;
+	for (j = lo; j < nmatches; j++)
+	{
+		int start = editorRowCxToRx(row, match[j].off);
+		if (start >= to)
+		{
+			break;
+		}
+		int end = editorRowCxToRx(row, match[j].off + querylen);
+		if (end <= from)
+		{
+			continue;
+		}
+		if (n == cap)
+		{
+			int old = cap;
+			cap = (cap == 0) ? 16 : cap * 2;
+			buf = memRealloc(MEM_SEARCH, buf, sizeof(struct matchRange) * old,
+				sizeof(struct matchRange) * cap);
+		}
+		buf[n].start = start;
+		buf[n].end = end;
+		n++;
+	}
+	*ranges = buf;
+	return n;
+}
+
+/*
+ * Move `m` to the next match in direction `dir` of a query with too many
+ * matches to keep, wrapping around at the ends of the file.
+ */
+int
+editorFindStep(struct findMatch *m, int dir)
+{
+	int row = m->row;
+	int off = m->off + dir;
+	int j;
+	for (j = 0; j <= E.numrows; j++)
+	{
+		int count;
+		struct findMatch *match = editorFindRowMatches(row, &count);
+		int k;
+		for (k = 0; k < count; k++)
+		{
+			int at = (dir > 0) ? k : count - 1 - k;
+			if ((dir > 0) ? match[at].off >= off : match[at].off <= off)
+			{
+				*m = match[at];
+				return 1;
+			}
+		}
+		row = (row + dir + E.numrows) % E.numrows;
+		off = (dir > 0) ? 0 : INT_MAX;
+	}
+	return 0;
+}
+
+void
+editorFindCallback(char *query, int key)
+{
+	if (key == '\r' || key == '\x1b' || key == CTRL_KEY('q'))
+	{
+		editorFindReset();
+		return;
+	}
+
+	int dir = 0;
+	if (F.query == NULL || strcmp(F.query, query) != 0)
+	{
+		traceBegin("editorFindCallback scan");
+		editorFindUpdate(query);
+		traceEndArg("editorFindCallback scan", "matches",
+			(F.depth > 0) ? F.levels[F.depth - 1].nmatches : 0);
+		/* the first match in the file */
+		F.match.row = 0;
+		F.match.off = -1;
+		dir = 1;
+	}
+	else if (key == ARROW_RIGHT || key == ARROW_DOWN)
+	{
+		F.current++;
+		dir = 1;
+	}
+	else if (key == ARROW_LEFT || key == ARROW_UP)
+	{
+		F.current--;
+		dir = -1;
 	}
-	return rx;
-}
 
-int
-editorRowRxToCx(erow *row, int rx)
-{
-	int cur_rx = 0;
-	int cx;
-	for (cx = 0; cx < row->size; cx++)
+	if (F.depth == 0 || F.levels[F.depth - 1].nmatches == 0)
+	{
+		return;
+	}
+	struct findLevel *level = &F.levels[F.depth - 1];
+	if (F.current < 0)
+	{
+		F.current = level->nmatches - 1;
+	}
+	else if (F.current >= level->nmatches)
+	{
+		F.current = 0;
+	}
+
+	struct findMatch *match;
+	if (level->lazy)
 	{
-		if (row->chars[cx] == '\t')
+		if (dir != 0 && !editorFindStep(&F.match, dir))
 		{
-			cur_rx += (KILO_TAB_STOP - 1) - (cur_rx % KILO_TAB_STOP);
+			return;
 		}
-		cur_rx++;
+		match = &F.match;
+	}
+	else
+	{
+		match = &level->matches[F.current];
+	}
+	E.cy = match->row;
+	E.cx = match->off;
+	E.rowoff = E.numrows;
+	/* the same for soft wrap, the match scrolls to the top */
+	E.lineoff = (long long)1 << 62;
+}
 
-		if (cur_rx > rx)
+void
+editorFind(void)
+{
+	if (V.active)
+	{
+		editorPagerFind();
+		return;
+	}
+	int saved_cx = E.cx;
+	int saved_cy = E.cy;
+	int saved_coloff = E.coloff;
+	int saved_rowoff = E.rowoff;
+	long long saved_lineoff = E.lineoff;
+
+	char *query = editorPrompt("Search: %s (Use ESC/Ctrl-Q/Arrows/Enter)", editorFindCallback);
+	if (query)
+	{
+		memFree(MEM_OTHER, query, strlen(query) + 1);
+	}
+	else
+	{
+		E.cx = saved_cx;
+		E.cy = saved_cy;
+		E.coloff = saved_coloff;
+		E.rowoff = saved_rowoff;
+		E.lineoff = saved_lineoff;
+	}
+}
+
+/*** pager ***/
+
+/*
+ * kilo -R shows a file read-only and keeps only a window of rows around
+ * the cursor in memory. Rows are read again from the file as the view
+ * moves, so files larger than memory can be paged through and searched.
+ */
+
+/* read `len` bytes at `offset` into V.buf */
+ssize_t
+editorPagerFetch(long long offset, size_t len)
+{
+	if (len > V.bufcap)
+	{
+		V.buf = memRealloc(MEM_ROWS, V.buf, V.bufcap, len);
+		V.bufcap = len;
+	}
+	size_t done = 0;
+	while (done < len)
+	{
+#ifndef _WIN32
+		ssize_t n = pread(V.fd, &V.buf[done], len - done, offset + done);
+#else
+		ssize_t n = -1;
+#endif
+		if (n <= 0)
 		{
-			return cx;
+			return -1;
 		}
+		done += n;
 	}
-	return cx;
+	return done;
 }
 
+/* add a row read from [start, next) of the file at `at` of the window */
 void
-editorUpdateRow(erow *row)
+editorPagerInsertRow(int at, char *s, size_t len, long long start, long long next)
 {
-	int tabs = 0;
-	int j;
-	for (j = 0; j < row->size; j++)
+	if (E.numrows + 2 > V.cap)
 	{
-		if (row->chars[j] == '\t')
+		int cap = (E.numrows + 2) * 2;
+		V.offsets = memRealloc(MEM_ROWS, V.offsets, sizeof(long long) * V.cap,
+			sizeof(long long) * cap);
+		V.cap = cap;
+	}
+	if (at == E.numrows)
+	{
+		V.offsets[at + 1] = next;
+	}
+	else
+	{
+		memmove(&V.offsets[at + 1], &V.offsets[at],
+			sizeof(long long) * (E.numrows + 1 - at));
+		V.offsets[at] = start;
+	}
+	if (len > 0 && s[len - 1] == '\r')
+	{
+		len--;
+	}
+	editorInsertRow(at, s, len);
+	E.dirty = 0;
+}
+
+/* offset just after the end of the row that goes on at `offset` */
+long long
+editorPagerRowEnd(long long offset)
+{
+	while (offset < V.size)
+	{
+		long long len = V.size - offset;
+		if (len > KILO_PAGER_BLOCK)
 		{
-			tabs++;
+			len = KILO_PAGER_BLOCK;
+		}
+		if (editorPagerFetch(offset, len) == -1)
+		{
+			break;
+		}
+		char *nl = memchr(V.buf, '\n', len);
+		if (nl != NULL)
+		{
+			return offset + (nl - V.buf) + 1;
 		}
+		offset += len;
 	}
+	return V.size;
+}
 
-	free(row->render);
-	row->render = malloc(row->size + tabs * (KILO_TAB_STOP - 1) + 1);
+/* read up to `n` rows following the window */
+int
+editorPagerAppend(int n)
+{
+	int added = 0;
+	while (added < n && V.offsets[E.numrows] < V.size)
+	{
+		long long from = V.offsets[E.numrows];
+		long long len = V.size - from;
+		if (len > KILO_PAGER_BLOCK)
+		{
+			len = KILO_PAGER_BLOCK;
+		}
+		if (editorPagerFetch(from, len) == -1)
+		{
+			break;
+		}
+		char *p = V.buf;
+		char *stop = V.buf + len;
+		int before = added;
+		while (added < n && p < stop)
+		{
+			char *nl = memchr(p, '\n', stop - p);
+			if (nl == NULL && from + len < V.size)
+			{
+				break;
+			}
+			char *end = (nl != NULL) ? nl : stop;
+			editorPagerInsertRow(E.numrows, p, end - p, from + (p - V.buf),
+				from + (end - V.buf) + (nl != NULL));
+			added++;
+			p = end + 1;
+		}
+		if (added == before)
+		{
+			/* a row longer than the block, keep only its start */
+			long long next = editorPagerRowEnd(from + len);
+			if (editorPagerFetch(from, len) == -1)
+			{
+				break;
+			}
+			editorPagerInsertRow(E.numrows, V.buf, len, from, next);
+			added++;
+		}
+	}
+	return added;
+}
 
-	int idx = 0;
-	for (j = 0; j < row->size; j++)
+/* read up to `n` rows preceding the window */
+int
+editorPagerPrepend(int n)
+{
+	/* find where the rows start, the window begins after a newline */
+	long long start = V.offsets[0];
+	long long q = start - 1;
+	int rows = 0;
+	while (rows < n && start > 0)
 	{
-		if (row->chars[j] == '\t')
+		long long from = (q > KILO_PAGER_BLOCK) ? q - KILO_PAGER_BLOCK : 0;
+		if (q > from && editorPagerFetch(from, q - from) == -1)
 		{
-			row->render[idx++] = ' ';
-			while (idx % KILO_TAB_STOP != 0)
+			break;
+		}
+		char *p = V.buf + (q - from);
+		while (rows < n && p > V.buf)
+		{
+			p--;
+			if (*p == '\n')
 			{
-				row->render[idx++] = ' ';
+				rows++;
+				start = from + (p - V.buf) + 1;
 			}
 		}
-		else
+		q = from;
+		if (from == 0 && rows < n)
 		{
-			row->render[idx++] = row->chars[j];
+			rows++;
+			start = 0;
 		}
 	}
-	row->render[idx] = '\0';
-	row->rsize = idx;
+	if (rows == 0)
+	{
+		return 0;
+	}
 
-	editorUpdateSyntax(row);
+	/*
+	 * Read them in file order on their own and put the window after them,
+	 * instead of moving the whole window for each row.
+	 */
+	erow *row = E.row;
+	int numrows = E.numrows;
+	int rowcap = E.rowcap;
+	long long *offsets = V.offsets;
+	int cap = V.cap;
+	E.row = NULL;
+	E.numrows = 0;
+	E.rowcap = 0;
+	V.cap = rows + numrows + 2;
+	V.offsets = memAlloc(MEM_ROWS, sizeof(long long) * V.cap);
+	V.offsets[0] = start;
+	int added = editorPagerAppend(rows);
+
+	if (E.numrows + numrows > E.rowcap)
+	{
+		int old = E.rowcap;
+		E.rowcap = E.numrows + numrows;
+		E.row = memRealloc(MEM_ROWS, E.row, sizeof(erow) * old,
+			sizeof(erow) * E.rowcap);
+	}
+	if (numrows > 0)
+	{
+		memcpy(&E.row[added], row, sizeof(erow) * numrows);
+	}
+	memcpy(&V.offsets[added], offsets, sizeof(long long) * (numrows + 1));
+	E.numrows += numrows;
+	int j;
+	for (j = added; j < E.numrows; j++)
+	{
+		E.row[j].idx = j;
+	}
+	memFree(MEM_ROWS, row, sizeof(erow) * rowcap);
+	memFree(MEM_ROWS, offsets, sizeof(long long) * cap);
+	if (numrows > 0)
+	{
+		/* a comment may be open at the end of the rows read */
+		editorUpdateSyntax(&E.row[added]);
+	}
+	W.stale = 1;
+	return added;
 }
 
+/* forget `n` rows of the window starting at `at` */
 void
-editorInsertRow(int at, char *s, size_t len)
+editorPagerDrop(int at, int n)
 {
-	if (at < 0 || at > E.numrows)
+	if (n == 0)
 	{
 		return;
 	}
-
-	E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-	memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
 	int j;
-	for (j = at + 1; j <= E.numrows; j++)
+	for (j = at; j < at + n; j++)
 	{
-		E.row[j].idx++;
+		editorFreeRow(&E.row[j]);
+	}
+	memmove(&E.row[at], &E.row[at + n], sizeof(erow) * (E.numrows - at - n));
+	/* dropping the end, the window ends where the first dropped row began */
+	if (at + n < E.numrows)
+	{
+		memmove(&V.offsets[at], &V.offsets[at + n],
+			sizeof(long long) * (E.numrows + 1 - at - n));
+	}
+	E.numrows -= n;
+	for (j = at; j < E.numrows; j++)
+	{
+		E.row[j].idx = j;
 	}
+	W.stale = 1;
+	editorLineIndexRows(at);
+}
 
-	E.row[at].idx = at;
+/* screen lines taken up by the first `n` rows of the window */
+long long
+editorPagerLines(int n)
+{
+	if (!W.enabled)
+	{
+		return n;
+	}
+	editorWrapSync();
+	return editorWrapPrefix(n);
+}
 
-	E.row[at].size = len;
-	E.row[at].chars = malloc(len + 1);
-	memcpy(E.row[at].chars, s, len);
-	E.row[at].chars[len] = '\0';
+/* mark the matches of the current search again after rows moved */
+void
+editorPagerRefind(void)
+{
+	if (F.query == NULL)
+	{
+		return;
+	}
+	char *query = memStrdup(MEM_SEARCH, F.query);
+	editorFindReset();
+	editorFindUpdate(query);
+	memFree(MEM_SEARCH, query, strlen(query) + 1);
+}
 
-	E.row[at].rsize = 0;
-	E.row[at].render = NULL;
-	E.row[at].hl = NULL;
-	E.row[at].hl_open_comment = 0;
-	editorUpdateRow(&E.row[at]);
+/*
+ * Read the rows around the cursor that are not in the window yet, and
+ * drop the ones far from it. Called before scrolling.
+ */
+void
+editorPagerFill(void)
+{
+	int margin = KILO_PAGER_MARGIN;
+	if (margin < 2 * E.screenrows)
+	{
+		margin = 2 * E.screenrows;
+	}
+	int moved = 0;
 
-	E.numrows++;
-	E.dirty++;
+	if (E.cy < margin && V.offsets[0] > 0)
+	{
+		int added = editorPagerPrepend(margin);
+		long long lines = editorPagerLines(added);
+		E.cy += added;
+		E.rowoff += added;
+		E.lineoff += lines;
+		S.top += lines;
+		moved |= added;
+	}
+	if (E.numrows - E.cy < margin + E.screenrows)
+	{
+		moved |= editorPagerAppend(margin + E.screenrows);
+	}
+
+	int extra = E.numrows - KILO_PAGER_ROWS;
+	int front = E.cy - margin;
+	if (front > extra)
+	{
+		front = extra;
+	}
+	if (front > 0)
+	{
+		long long lines = editorPagerLines(front);
+		editorPagerDrop(0, front);
+		E.cy -= front;
+		E.rowoff -= front;
+		E.lineoff -= lines;
+		S.top -= lines;
+		extra -= front;
+		moved = 1;
+	}
+	if (extra > 0)
+	{
+		editorPagerDrop(E.numrows - extra, extra);
+		moved = 1;
+	}
+
+	/* the matches hold row numbers of the window */
+	if (moved)
+	{
+		editorPagerRefind();
+	}
 }
 
+/* move the cursor to byte `offset`, reading the window again around it */
 void
-editorFreeRow(erow *row)
+editorPagerSeek(long long offset)
+{
+	if (offset > V.size)
+	{
+		offset = V.size;
+	}
+	if (offset < V.offsets[0] || offset >= V.offsets[E.numrows])
+	{
+		editorPagerDrop(0, E.numrows);
+		/* start of the row holding the offset */
+		long long start = offset;
+		while (start > 0)
+		{
+			long long from = (start > KILO_PAGER_BLOCK) ? start - KILO_PAGER_BLOCK : 0;
+			if (editorPagerFetch(from, start - from) == -1)
+			{
+				break;
+			}
+			char *p = V.buf + (start - from);
+			while (p > V.buf && p[-1] != '\n')
+			{
+				p--;
+			}
+			start = from + (p - V.buf);
+			if (p > V.buf)
+			{
+				break;
+			}
+		}
+		V.offsets[0] = start;
+		editorPagerAppend(KILO_PAGER_MARGIN);
+	}
+
+	int lo = 0;
+	int hi = E.numrows;
+	while (lo < hi)
+	{
+		int mid = (lo + hi) / 2;
+		if (V.offsets[mid + 1] <= offset)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+	E.cy = lo;
+	E.cx = 0;
+	if (lo < E.numrows)
+	{
+		E.cx = offset - V.offsets[lo];
+		if (E.cx > E.row[lo].size)
+		{
+			E.cx = E.row[lo].size;
+		}
+	}
+	/* show the row at the top of the screen */
+	E.rowoff = E.numrows;
+	E.lineoff = (long long)1 << 62;
+}
+
+/* file offset where line `line`, counted from 1, starts */
+long long
+editorPagerLineOffset(long long line)
 {
-	free(row->chars);
-	free(row->render);
-	free(row->hl);
+	long long offset = 0;
+	while (line > 1 && offset < V.size)
+	{
+		size_t len = (V.size - offset < KILO_PAGER_BLOCK) ?
+			V.size - offset : KILO_PAGER_BLOCK;
+		if (editorPagerFetch(offset, len) == -1)
+		{
+			break;
+		}
+		char *p = V.buf;
+		char *stop = V.buf + len;
+		while (line > 1 && (p = memchr(p, '\n', stop - p)) != NULL)
+		{
+			p++;
+			line--;
+		}
+		offset += (line > 1) ? (long long)len : p - V.buf;
+	}
+	return offset;
 }
 
-void
-editorDelRow(int at)
+/*
+ * Offset of the first match of `query` at or after `from` when `dir` is
+ * 1, or of the last one at or before it when `dir` is -1. Returns -1 if
+ * there is none.
+ */
+long long
+editorPagerSearch(const char *query, long long from, int dir)
 {
-	if (at < 0 || at >= E.numrows)
+	long long qlen = strlen(query);
+	long long lo = (dir > 0) ? from : from + qlen - KILO_PAGER_BLOCK;
+	if (lo < 0)
 	{
-		return;
+		lo = 0;
 	}
-	editorFreeRow(&E.row[at]);
-	memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-	int j;
-	for (j = at; j < E.numrows - 1; j++)
+	while (lo >= 0 && lo + qlen <= V.size)
 	{
-		E.row[j].idx--;
+		long long hi = (dir > 0) ? lo + KILO_PAGER_BLOCK : from + qlen;
+		if (hi > V.size)
+		{
+			hi = V.size;
+		}
+		if (editorPagerFetch(lo, hi - lo) == -1)
+		{
+			return -1;
+		}
+		long long found = -1;
+		char *p = V.buf;
+		char *stop = V.buf + (hi - lo) - qlen + 1;
+		while (p < stop && (p = memchr(p, query[0], stop - p)) != NULL)
+		{
+			if (memcmp(p, query, qlen) == 0)
+			{
+				found = lo + (p - V.buf);
+				if (dir > 0)
+				{
+					break;
+				}
+			}
+			p++;
+		}
+		if (found != -1)
+		{
+			return found;
+		}
+
+		/* blocks overlap by the length of the query */
+		if (dir > 0)
+		{
+			if (hi == V.size)
+			{
+				break;
+			}
+			lo = hi - qlen + 1;
+		}
+		else
+		{
+			if (lo == 0)
+			{
+				break;
+			}
+			from = lo - 1;
+			lo = (from + qlen > KILO_PAGER_BLOCK) ? from + qlen - KILO_PAGER_BLOCK : 0;
+		}
 	}
-	E.numrows--;
-	E.dirty++;
+	return -1;
 }
 
-void
-editorRowInsertChar(erow *row, int at, int c)
+/* editorPagerSearch, going on from the other end of the file */
+long long
+editorPagerSearchWrap(const char *query, long long from, int dir)
 {
-	if (at < 0 || at > row->size)
+	long long found = (from >= 0) ? editorPagerSearch(query, from, dir) : -1;
+	if (found == -1 && (dir > 0 ? from > 0 : from < V.size))
 	{
-		at = row->size;
+		found = editorPagerSearch(query, (dir > 0) ? 0 : V.size, dir);
 	}
-	row->chars = realloc(row->chars, row->size + 2);
-	memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-	row->size++;
-	row->chars[at] = c;
-	editorUpdateRow(row);
-	E.dirty++;
+	return found;
 }
 
+/* back to where the search started, with the screen as it was */
 void
-editorRowAppendString(erow *row, char *s, size_t len)
+editorPagerRestore(void)
 {
-	row->chars = realloc(row->chars, row->size + len + 1);
-	memcpy(&row->chars[row->size], s, len);
-	row->size += len;
-	row->chars[row->size] = '\0';
-	editorUpdateRow(row);
-	E.dirty++;
+	editorPagerSeek(V.top);
+	int top = E.cy;
+	editorPagerSeek(V.origin);
+	E.rowoff = top;
+	E.lineoff = editorPagerLines(top);
 }
 
 void
-editorRowDelChar(erow *row, int at)
+editorPagerFindCallback(char *query, int key)
 {
-	if (at < 0 || at >= row->size)
+	if (key == '\r' || key == '\x1b' || key == CTRL_KEY('q'))
 	{
+		editorFindReset();
 		return;
 	}
-	memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-	row->size--;
-	editorUpdateRow(row);
-	E.dirty++;
-}
 
-/*** editor operations ***/
-
-void
-editorInsertChar(int c)
-{
-	if (E.cy == E.numrows)
+	long long found = -1;
+	if (query[0] == '\0')
 	{
-		/* add empty line to end of file */
-		editorInsertRow(E.numrows, "", 0);
+		editorPagerRestore();
+		V.match = V.origin;
 	}
-	editorRowInsertChar(&E.row[E.cy], E.cx, c);
-	E.cx++;
-}
-
-void
-editorInsertNewline(void)
-{
-	if (E.cx == 0)
+	else if (F.query == NULL || strcmp(F.query, query) != 0)
 	{
-		editorInsertRow(E.cy, "", 0);
+		/* a longer query only matches where the one before did */
+		int longer = (F.query != NULL && F.query[0] != '\0' &&
+			strncmp(query, F.query, strlen(F.query)) == 0);
+		if (!longer || V.first != -1)
+		{
+			found = editorPagerSearchWrap(query, longer ? V.first : V.origin, 1);
+		}
+		V.first = found;
 	}
-	else
+	else if (key == ARROW_RIGHT || key == ARROW_DOWN)
 	{
-		erow *row = &E.row[E.cy];
-		editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-		row = &E.row[E.cy];
-		row->size = E.cx;
-		row->chars[row->size] = '\0';
-		editorUpdateRow(row);
+		found = editorPagerSearchWrap(query, V.match + 1, 1);
 	}
-	E.cy++;
-	E.cx = 0;
-}
-
-void
-editorDelChar(void)
-{
-	if (E.cy == E.numrows)
+	else if (key == ARROW_LEFT || key == ARROW_UP)
 	{
-		return;
+		found = editorPagerSearchWrap(query, V.match - 1, -1);
 	}
-	if (E.cx == 0 && E.cy == 0)
+	if (found != -1)
 	{
-		return;
+		long long start = V.offsets[0];
+		V.match = found;
+		editorPagerSeek(found);
+		if (V.offsets[0] != start)
+		{
+			/* the window was read again, its matches are gone */
+			editorFindReset();
+		}
 	}
+	editorFindUpdate(query);
+}
 
-	erow *row = &E.row[E.cy];
-	if (E.cx > 0)
+void
+editorPagerFind(void)
+{
+	V.origin = (E.cy < E.numrows) ? V.offsets[E.cy] + E.cx : V.offsets[E.numrows];
+	V.top = V.offsets[(E.rowoff < E.numrows) ? E.rowoff : E.numrows];
+	V.match = V.origin;
+	V.first = -1;
+
+	char *query = editorPrompt("Search: %s (Use ESC/Ctrl-Q/Arrows/Enter)",
+		editorPagerFindCallback);
+	if (query)
 	{
-		editorRowDelChar(row, E.cx - 1);
-		E.cx--;
+		memFree(MEM_OTHER, query, strlen(query) + 1);
 	}
 	else
 	{
-		E.cx = E.row[E.cy - 1].size;
-		editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-		editorDelRow(E.cy);
-		E.cy--;
+		editorPagerRestore();
 	}
 }
 
-/*** file i/o ***/
-
-char *
-editorRowsToString(size_t *buflen)
+/* keys that would change the file, refused by the pager */
+int
+editorPagerEdits(int c)
 {
-	int totlen = 0;
-	int j;
-	for (j = 0; j < E.numrows; j++)
+	switch (c)
 	{
-		totlen += E.row[j].size + 1;
+	case '\r':
+	case BACKSPACE:
+	case CTRL_KEY('h'):
+	case DEL_KEY:
+	case CTRL_KEY('s'):
+	case CTRL_KEY('z'):
+	case CTRL_KEY('y'):
+		return 1;
+	case CTRL_KEY('q'):
+	case CTRL_KEY('f'):
+	case CTRL_KEY('g'):
+	case CTRL_KEY('l'):
+	case CTRL_KEY('p'):
+	case CTRL_KEY('t'):
+	case CTRL_KEY('w'):
+	case '\x1b':
+		return 0;
 	}
-	*buflen = totlen;
+	/* characters that would be inserted */
+	return c < ARROW_LEFT;
+}
 
-	char *buf = malloc(totlen);
-	char *p = buf;
-	for (j = 0; j < E.numrows; j++)
+#ifndef _WIN32
+/* watch the file for writes, or for being renamed or deleted */
+void
+editorFollowWatch(void)
+{
+#ifdef __linux__
+	if (N.fd == -1)
 	{
-		memcpy(p, E.row[j].chars, E.row[j].size);
-		p += E.row[j].size;
-		*p = '\n';
-		p++;
+		N.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
 	}
-	return buf;
+	if (N.fd != -1 && N.wd != -1)
+	{
+		inotify_rm_watch(N.fd, N.wd);
+	}
+	N.wd = (N.fd == -1) ? -1 : inotify_add_watch(N.fd, E.filename,
+		IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+#endif
 }
 
+/* put the cursor after the last row, shown at the bottom of the screen */
 void
-editorOpen(char *filename)
+editorFollowEnd(void)
 {
-	free(E.filename);
-	E.filename = strdup(filename);
-
-	editorSelectSyntaxHighlight();
+	E.cy = E.numrows;
+	E.cx = 0;
+	editorPagerFill();
+	E.rowoff = 0;
+	E.lineoff = 0;
+}
 
-	FILE *fp = fopen(filename, "r");
-	if (!fp)
+/*
+ * Read what was appended to the followed file. The view follows the end
+ * when the cursor is on the last row. A file that shrank or was replaced
+ * by a new one under the same name is read again from the start.
+ */
+void
+editorFollowCheck(void)
+{
+	struct stat st;
+	if (!N.active || fstat(V.fd, &st) == -1)
 	{
-		die("fopen");
+		return;
 	}
+	int at_end = (E.cy >= E.numrows - 1 && V.offsets[E.numrows] >= V.size);
 
-	char *line = NULL;
-	size_t linecap = 0;
-	ssize_t linelen;
-	while ((linelen = getline(&line, &linecap, fp)) != -1)
+	struct stat now;
+	int found = (stat(E.filename, &now) == 0);
+	int replaced = (found &&
+		(now.st_ino != st.st_ino || now.st_dev != st.st_dev));
+	if (replaced)
 	{
-		while (linelen > 0 &&
-			(line[linelen - 1] == '\r' || line[linelen - 1] == '\n'))
+		int fd = open(E.filename, O_RDONLY | O_CLOEXEC);
+		if (fd == -1 || fstat(fd, &st) == -1)
 		{
-			linelen--;
+			return;
 		}
-
-		editorInsertRow(E.numrows, line, linelen);
+		close(V.fd);
+		V.fd = fd;
+		editorFollowWatch();
 	}
-	free(line);
-	fclose(fp);
-	E.dirty = 0;
-}
-
-void
-editorSave(void)
-{
-	int is_new_file = 0;
-
-	if (E.filename == NULL)
+	else if (N.wd == -1)
 	{
-		E.filename = editorPrompt("Save as: %s (ESC or Ctrl-Q to cancel)", NULL);
-		if (E.filename == NULL)
+		if (!found)
 		{
-			editorSetStatusMessage("Save aborted");
+			/* the file is gone and nothing took its place yet */
 			return;
 		}
-		editorSelectSyntaxHighlight();
-		is_new_file = 1;
+		/* the name leads to the same file again, watch it again */
+		editorFollowWatch();
 	}
 
-	size_t len;
-	char *buf = editorRowsToString(&len);
-
-	FILE *fp = fopen(E.filename, (is_new_file ? "wx" : "w"));
-	if (fp)
+	if (replaced || st.st_size < V.size)
 	{
-		if (fwrite(buf, 1, len, fp) == len)
+		editorPagerDrop(0, E.numrows);
+		V.offsets[0] = 0;
+		V.size = st.st_size;
+		E.cy = 0;
+		E.cx = 0;
+		E.rowoff = 0;
+		E.lineoff = 0;
+		if (!at_end)
 		{
-			fclose(fp);
-			free(buf);
-			E.dirty = 0;
-			editorSetStatusMessage("%d bytes written to disk", len);
 			return;
 		}
-		fclose(fp);
 	}
-	editorSetStatusMessage("Cannot save! I/O error: %s", strerror(errno));
-	free(buf);
+	else if (st.st_size > V.size)
+	{
+		/* the last row was not finished, read it again */
+		if (E.numrows > 0 && V.offsets[E.numrows] == V.size &&
+			editorPagerFetch(V.size - 1, 1) == 1 && V.buf[0] != '\n')
+		{
+			editorPagerDrop(E.numrows - 1, 1);
+		}
+		V.size = st.st_size;
+	}
+	else
+	{
+		return;
+	}
 
-	if (is_new_file)
+	if (at_end)
 	{
-		free(E.filename);
-		E.filename = NULL;
+		if (V.size - V.offsets[E.numrows] > KILO_PAGER_BLOCK)
+		{
+			/* more than a screen can show, start again near the end */
+			editorPagerSeek(V.size);
+		}
+		else
+		{
+			editorPagerAppend(INT_MAX);
+		}
+		editorFollowEnd();
 	}
 }
 
-/*** find ***/
-
-void
-editorFindCallback(char *query, int key)
+int
+editorPagerOpen(char *filename)
 {
-	static int last_match = -1;
-	static int direction = 1;
-
-	static int saved_hl_line = 0;
-	static char *saved_hl = NULL;
-
-	if (saved_hl)
+	V.fd = open(filename, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (V.fd == -1 || fstat(V.fd, &st) == -1)
+	{
+		die("open");
+	}
+	if (editorCompression(V.fd) != NULL)
 	{
-		memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-		free(saved_hl);
-		saved_hl = NULL;
+		/* compressed text cannot be read at an offset, read all of it */
+		close(V.fd);
+		editorOpen(filename);
+		return -1;
 	}
+	E.filename = memStrdup(MEM_OTHER, filename);
+	editorSelectSyntaxHighlight();
+
+	V.active = 1;
+	V.size = st.st_size;
+	V.cap = 64;
+	V.offsets = memAlloc(MEM_ROWS, sizeof(long long) * V.cap);
+	V.offsets[0] = 0;
+	/* nothing is edited, there is nothing to undo */
+	E.undo.suspended++;
+	return 0;
+}
 
-	if (key == '\t' || key == '\x1b')
+void
+editorFollowOpen(char *filename)
+{
+	if (editorPagerOpen(filename) == -1)
 	{
-		last_match = -1;
-		direction = 1;
 		return;
 	}
-	else if (key == ARROW_RIGHT || key == ARROW_DOWN)
+	N.active = 1;
+	N.fd = -1;
+	N.wd = -1;
+	editorFollowWatch();
+	editorPagerSeek(V.size);
+	editorFollowEnd();
+}
+#else
+/* there is no follow mode, FILE_EVENT never arrives */
+void
+editorFollowCheck(void)
+{
+}
+#endif
+
+/*** stream ***/
+
+#ifndef _WIN32
+/* reader thread, waits while the editor is a full buffer behind */
+void *
+editorStreamThread(void *arg)
+{
+	(void)arg;
+	char block[64 * 1024];
+	while (1)
 	{
-		direction = 1;
+		ssize_t n = read(D.fd, block, sizeof(block));
+		if (n == -1 && errno == EINTR)
+		{
+			continue;
+		}
+		pthread_mutex_lock(&D.lock);
+		if (n <= 0)
+		{
+			D.eof = 1;
+		}
+		else
+		{
+			while (D.len[D.back] + n > KILO_STREAM_BUFFER)
+			{
+				pthread_cond_wait(&D.taken, &D.lock);
+			}
+			memcpy(&D.buf[D.back][D.len[D.back]], block, n);
+			D.len[D.back] += n;
+		}
+		pthread_mutex_unlock(&D.lock);
+		atomic_store(&D.ready, 1);
+		if (write(K.wake[1], "", 1) == -1)
+		{
+			/* the pipe is full of wake ups already */
+		}
+		if (n <= 0)
+		{
+			break;
+		}
 	}
-	else if (key == ARROW_LEFT || key == ARROW_UP)
+	return NULL;
+}
+
+void
+editorStreamRow(char *s, size_t len)
+{
+	int eol = 1;
+	if (len > 0 && s[len - 1] == '\r')
 	{
-		direction = -1;
+		len--;
+		eol = 2;
 	}
-	else
+	editorInsertRow(E.numrows, s, len);
+	E.row[E.numrows - 1].eol = eol;
+}
+
+/* keep the start of a row until the rest of it is read */
+void
+editorStreamKeep(char *s, int len)
+{
+	if (D.linelen + len > D.linecap)
 	{
-		last_match = -1;
-		direction = 1;
+		int cap = (D.linelen + len) * 2;
+		D.line = memRealloc(MEM_OTHER, D.line, D.linecap, cap);
+		D.linecap = cap;
 	}
+	memcpy(&D.line[D.linelen], s, len);
+	D.linelen += len;
+}
 
-	if (last_match == -1)
+/*
+ * Add the rows read since the last call after the last row. They are
+ * part of the file as opened, so they are neither undone nor make it
+ * modified.
+ */
+void
+editorStreamTake(void)
+{
+	if (!D.active || !atomic_exchange(&D.ready, 0))
+	{
+		return;
+	}
+	pthread_mutex_lock(&D.lock);
+	int front = D.back;
+	D.back = !D.back;
+	int eof = D.eof;
+	pthread_cond_signal(&D.taken);
+	pthread_mutex_unlock(&D.lock);
+
+	int dirty = E.dirty;
+	E.undo.suspended++;
+	char *p = D.buf[front];
+	char *stop = p + D.len[front];
+	while (p < stop)
 	{
-		direction = 1;
+		char *nl = memchr(p, '\n', stop - p);
+		char *end = (nl != NULL) ? nl : stop;
+		if (nl == NULL || D.linelen > 0)
+		{
+			editorStreamKeep(p, end - p);
+		}
+		if (nl == NULL)
+		{
+			break;
+		}
+		if (D.linelen > 0)
+		{
+			editorStreamRow(D.line, D.linelen);
+			D.linelen = 0;
+		}
+		else
+		{
+			editorStreamRow(p, end - p);
+		}
+		p = nl + 1;
 	}
-	int current = last_match;
+	D.total += D.len[front];
+	D.len[front] = 0;
 
-	int i;
-	for (i = 0; i < E.numrows; i++)
+	if (eof)
 	{
-		current += direction;
-		if (current < 0)
+		if (D.linelen > 0)
 		{
-			current = E.numrows - 1;
+			editorStreamRow(D.line, D.linelen);
 		}
-		else if (current >= E.numrows)
+		pthread_join(D.thread, NULL);
+		close(D.fd);
+		memFree(MEM_OTHER, D.buf[0], KILO_STREAM_BUFFER);
+		memFree(MEM_OTHER, D.buf[1], KILO_STREAM_BUFFER);
+		memFree(MEM_OTHER, D.line, D.linecap);
+		D.active = 0;
+		int status = 0;
+		if (D.pid > 0)
 		{
-			current = 0;
+			waitpid(D.pid, &status, 0);
 		}
-		erow *row = &E.row[current];
-		char *match = strstr(row->render, query);
-		if (match)
+		if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
 		{
-			last_match = current;
-			E.cy = current;
-			E.cx = editorRowRxToCx(row, match - row->render);
-			E.rowoff = E.numrows;
-
-			saved_hl_line = current;
-			saved_hl = malloc(row->rsize);
-			memcpy(saved_hl, row->hl, row->rsize);
-			memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-			break;
+			editorSetStatusMessage("%lld bytes read from %s", D.total,
+				E.filename ? E.filename : "standard input");
+		}
+		else
+		{
+			editorSetStatusMessage("%s could not read all of %s", E.compress, E.filename);
 		}
 	}
+	E.undo.suspended--;
+	E.dirty = dirty;
 }
 
+/*
+ * Read the file from standard input, which is a pipe, and keys from the
+ * terminal instead. Called before the terminal is set up.
+ */
 void
-editorFind(void)
+editorStreamOpen(void)
 {
-	int saved_cx = E.cx;
-	int saved_cy = E.cy;
-	int saved_coloff = E.coloff;
-	int saved_rowoff = E.rowoff;
-
-	char *query = editorPrompt("Search: %s (Use ESC/Ctrl-Q/Arrows/Enter)", editorFindCallback);
-	if (query)
+	int fd = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 0);
+	if (fd == -1)
 	{
-		free(query);
+		die("dup");
 	}
-	else
-	{
-		E.cx = saved_cx;
-		E.cy = saved_cy;
-		E.coloff = saved_coloff;
-		E.rowoff = saved_rowoff;
+	/* replays take their keys from the trace, not the terminal */
+	if (!R.active)
+	{
+		int tty = open("/dev/tty", O_RDWR);
+		if (tty == -1 || dup2(tty, STDIN_FILENO) == -1)
+		{
+			die("open");
+		}
+		close(tty);
 	}
+	editorStreamInit(fd);
+}
+
+/* read the file from `fd` on the reader thread once it is started */
+void
+editorStreamInit(int fd)
+{
+	D.fd = fd;
+	D.buf[0] = memAlloc(MEM_OTHER, KILO_STREAM_BUFFER);
+	D.buf[1] = memAlloc(MEM_OTHER, KILO_STREAM_BUFFER);
+	atomic_init(&D.ready, 0);
+	pthread_mutex_init(&D.lock, NULL);
+	pthread_cond_init(&D.taken, NULL);
+	D.active = 1;
+}
+#else
+/* standard input is not read on Windows, FILE_EVENT never arrives */
+void
+editorStreamTake(void)
+{
+}
+#endif
+
+/* the followed file or standard input has new data */
+void
+editorFileEvent(void)
+{
+	editorFollowCheck();
+	editorStreamTake();
 }
 
 /*** append buffer ***/
@@ -1117,12 +6459,8 @@ struct abuf
 void
 abAppend(struct abuf *ab, const char *s, int len)
 {
-	char *new = realloc(ab->b, ab->len + len);
+	char *new = memRealloc(MEM_FRAME, ab->b, ab->len, ab->len + len);
 
-	if (new == NULL)
-	{
-		return;
-	}
 	memcpy(&new[ab->len], s, len);
 	ab->b = new;
 	ab->len += len;
@@ -1131,7 +6469,7 @@ abAppend(struct abuf *ab, const char *s, int len)
 void
 abFree(struct abuf *ab)
 {
-	free(ab->b);
+	memFree(MEM_FRAME, ab->b, ab->len);
 }
 
 /*** input ***/
@@ -1140,7 +6478,7 @@ char *
 editorPrompt(char *prompt, void (*callback)(char *, int))
 {
 	size_t bufsize = 128;
-	char *buf = malloc(bufsize);
+	char *buf = memAlloc(MEM_OTHER, bufsize);
 
 	size_t buflen = 0;
 	buf[0] = '\0';
@@ -1148,7 +6486,7 @@ editorPrompt(char *prompt, void (*callback)(char *, int))
 	while (1)
 	{
 		editorSetStatusMessage(prompt, buf);
-		editorRefreshScreen();
+		editorFrame();
 
 		int c = editorReadKey();
 		if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE)
@@ -1165,7 +6503,7 @@ editorPrompt(char *prompt, void (*callback)(char *, int))
 				{
 					callback(buf, c);
 				}
-				free(buf);
+				memFree(MEM_OTHER, buf, bufsize);
 				return NULL;
 		}
 		else if (c == '\r')
@@ -1177,15 +6515,22 @@ editorPrompt(char *prompt, void (*callback)(char *, int))
 				{
 					callback(buf, c);
 				}
-				return buf;
+				/* callers free the answer by its length */
+				char *answer = memStrdup(MEM_OTHER, buf);
+				memFree(MEM_OTHER, buf, bufsize);
+				return answer;
 			}
 		}
-		else if (!iscntrl(c) && c < 128)
+		else if (c == FILE_EVENT)
+		{
+			editorFileEvent();
+		}
+		else if (c < 128 && !iscntrl(c))
 		{
 			if (buflen == bufsize - 1)
 			{
+				buf = memRealloc(MEM_OTHER, buf, bufsize, bufsize * 2);
 				bufsize *= 2;
-				buf = realloc(buf, bufsize);
 			}
 			buf[buflen++] = c;
 			buf[buflen] = '\0';
@@ -1249,16 +6594,46 @@ editorMoveCursor(int key)
 	}
 }
 
+/*
+ * Called while waiting for input, housekeeping that must not happen
+ * while row contents are in use.
+ */
+void
+editorIdle(void)
+{
+	if (E.arena.wasted > KILO_ARENA_BLOCK && E.arena.wasted > E.arena.live / 2)
+	{
+		editorCompactRows();
+	}
+}
+
 void
 editorProcessKeypress(void)
 {
 	static int quit_times = KILO_QUIT_TIMES;
 
 	int c = editorReadKey();
+	E.undo.keys++;
+
+	if (c & KEY_MODIFIERS)
+	{
+		/* nothing is bound to modified keys, they act like plain ones */
+		if ((c & ~KEY_MODIFIERS) < ARROW_LEFT)
+		{
+			return;
+		}
+		c &= ~KEY_MODIFIERS;
+	}
+	if (V.active && editorPagerEdits(c))
+	{
+		editorSetStatusMessage("The file is open read-only");
+		return;
+	}
 
 	switch (c)
 	{
 	case '\r':
+		editorUndoBegin(UNDO_KIND_INSERT);
 		editorInsertNewline();
 		break;
 
@@ -1270,13 +6645,8 @@ editorProcessKeypress(void)
 			quit_times--;
 			return;
 		}
-#ifdef _WIN32
-		WriteConsole(GetStdHandle(STD_OUTPUT_HANDLE), "\x1b[2J", 4, NULL, NULL);
-		WriteConsole(GetStdHandle(STD_OUTPUT_HANDLE), "\x1b[H", 3, NULL, NULL);
-#else
-		write(STDOUT_FILENO, "\x1b[2J", 4);
-		write(STDOUT_FILENO, "\x1b[H", 3);
-#endif
+		editorWrite("\x1b[2J", 4);
+		editorWrite("\x1b[H", 3);
 		exit(0);
 		break;
 
@@ -1302,6 +6672,7 @@ editorProcessKeypress(void)
 	case BACKSPACE:
 	case CTRL_KEY('h'):
 	case DEL_KEY:
+		editorUndoBegin(UNDO_KIND_DELETE);
 		if (c == DEL_KEY)
 		{
 			editorMoveCursor(ARROW_RIGHT);
@@ -1311,6 +6682,11 @@ editorProcessKeypress(void)
 
 	case PAGE_UP:
 	case PAGE_DOWN:
+		if (W.enabled)
+		{
+			editorWrapPage(c);
+			break;
+		}
 		{
 			if (c == PAGE_UP)
 			{
@@ -1340,11 +6716,52 @@ editorProcessKeypress(void)
 		break;
 
 	case CTRL_KEY('l'):
+		/* repaint every row, in case the terminal was garbled */
+		if (S.valid != NULL)
+		{
+			memset(S.valid, 0, S.rows);
+		}
+		break;
+
 	case '\x1b':
 		/* TODO */
 		break;
 
+	case CTRL_KEY('p'):
+		P.overlay = !P.overlay;
+		break;
+
+	case CTRL_KEY('t'):
+		editorMemStatus();
+		break;
+
+	case CTRL_KEY('w'):
+		editorToggleWrap();
+		break;
+
+	case CTRL_KEY('g'):
+		editorGoto();
+		break;
+
+	case FILE_EVENT:
+		editorFileEvent();
+		break;
+
+	case CTRL_KEY('z'):
+		editorUndo();
+		break;
+
+	case CTRL_KEY('y'):
+		editorRedo();
+		break;
+
 	default:
+		/* function keys and mouse reports are not bound to anything */
+		if (c >= ARROW_LEFT)
+		{
+			break;
+		}
+		editorUndoBegin(UNDO_KIND_INSERT);
 		editorInsertChar(c);
 		break;
 	}
@@ -1357,12 +6774,35 @@ editorProcessKeypress(void)
 void
 editorScroll(void)
 {
+	if (V.active)
+	{
+		editorPagerFill();
+	}
 	E.rx = 0;
-	if (E.cy <= E.numrows)
+	if (E.cy < E.numrows)
 	{
 		E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
 	}
 
+	if (W.enabled)
+	{
+		/* whole rows are shown, scroll by screen lines */
+		editorWrapSync();
+		E.coloff = 0;
+		long long line = editorWrapCursor();
+		if (line < E.lineoff)
+		{
+			E.lineoff = line;
+		}
+		if (line >= E.lineoff + E.screenrows)
+		{
+			E.lineoff = line - E.screenrows + 1;
+		}
+		long long sub;
+		E.rowoff = editorWrapFind(E.lineoff, &sub);
+		return;
+	}
+
 	if (E.cy < E.rowoff)
 	{
 		E.rowoff = E.cy;
@@ -1381,99 +6821,288 @@ editorScroll(void)
 	}
 }
 
+/*
+ * Draw render columns `from` to `to` of a row. `render` and the runs in
+ * `hl` start at column `rx`. Search matches in `ranges` are drawn on top
+ * of the syntax highlighting.
+ */
 void
-editorDrawRows(struct abuf *ab)
+editorDrawSegment(struct abuf *ab, const char *render, const hlrun *hl, int nhl,
+	int rx, int from, int to, struct matchRange **ranges, int *nranges,
+	int *current_colour)
 {
-	int y;
+	int run = 0;
+	int run_end = rx + ((nhl > 0) ? (int)hl[0].len : 0);
+	int col = from;
 
-	for (y = 0; y < E.screenrows; y++)
+	while (col < to)
 	{
-		int filerow = y + E.rowoff;
-		if (filerow >= E.numrows)
+		while (run < nhl - 1 && run_end <= col)
+		{
+			run++;
+			run_end += hl[run].len;
+		}
+		int h = (nhl > 0) ? hl[run].hl : HL_NORMAL;
+		int end = (nhl > 0) ? run_end : to;
+
+		/* merge search matches on top of the syntax highlighting */
+		while (*nranges > 0 && (*ranges)->end <= col)
+		{
+			(*ranges)++;
+			(*nranges)--;
+		}
+		if (*nranges > 0 && (*ranges)->start <= col)
+		{
+			h = HL_MATCH;
+			end = (*ranges)->end;
+		}
+		else if (*nranges > 0 && (*ranges)->start < end)
+		{
+			end = (*ranges)->start;
+		}
+		if (end > to)
+		{
+			end = to;
+		}
+
+		if (h == HL_NORMAL)
 		{
-			if (E.numrows == 0 && y == E.screenrows / 3)
+			if (*current_colour != -1)
 			{
-				char welcome[80];
-				int welcomelen = snprintf(welcome, sizeof(welcome),
-					"Kilo editor -- version %s", KILO_VERSION);
-				if (welcomelen > E.screencols)
-				{
-					welcomelen = E.screencols;
-				}
-				int padding = (E.screencols - welcomelen) / 2;
-				if (padding > 0)
-				{
-					abAppend(ab, "~", 1);
-					padding--;
-				}
-				while (padding-- > 0)
+				abAppend(ab, "\x1b[39m", 5);
+				*current_colour = -1;
+			}
+		}
+		else
+		{
+			int colour = editorSyntaxToColour(h);
+			if (colour != *current_colour)
+			{
+				*current_colour = colour;
+				char buf[16];
+				int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", colour);
+				abAppend(ab, buf, clen);
+			}
+		}
+
+		const char *c = &render[-rx];
+		while (col < end)
+		{
+			if (iscntrl(c[col]))
+			{
+				char sym = (c[col] <= 26) ? '@' + c[col] : '?';
+				abAppend(ab, "\x1b[7m", 4);
+				abAppend(ab, &sym, 1);
+				abAppend(ab, "\x1b[m", 3);
+				if (*current_colour != -1)
 				{
-					abAppend(ab, " ", 1);
+					char buf[16];
+					int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", *current_colour);
+					abAppend(ab, buf, clen);
 				}
-				abAppend(ab, welcome, welcomelen);
+				col++;
+				continue;
 			}
-			else
+			int start = col;
+			while (col < end && !iscntrl(c[col]))
 			{
-				abAppend(ab, "~", 1);
+				col++;
 			}
+			abAppend(ab, &c[start], col - start);
 		}
-		else
+	}
+}
+
+void
+editorDrawRow(struct abuf *ab, erow *row, int from)
+{
+	int to = from + E.screencols;
+	if (to > row->rsize)
+	{
+		to = row->rsize;
+	}
+	if (from >= to)
+	{
+		return;
+	}
+
+	struct matchRange *ranges;
+	int nranges = editorFindRowRanges(row, from, to, &ranges);
+	int current_colour = -1;
+
+	if (row->nchunks == 0)
+	{
+		editorDrawSegment(ab, row->render, row->hl, row->nhl, 0, from, to,
+			&ranges, &nranges, &current_colour);
+		return;
+	}
+
+	/* long rows only expand and draw the chunks on screen */
+	int k;
+	for (k = editorRowChunkByRx(row, from); k < row->nchunks; k++)
+	{
+		struct rowchunk *ch = &row->chunks[k];
+		if (ch->rx >= to)
+		{
+			break;
+		}
+		int start = (ch->rx > from) ? ch->rx : from;
+		int end = (ch->rx + ch->rsize < to) ? ch->rx + ch->rsize : to;
+		if (start < end)
+		{
+			editorDrawSegment(ab, editorChunkRender(row, ch), ch->hl, ch->nhl,
+				ch->rx, start, end, &ranges, &nranges, &current_colour);
+		}
+	}
+}
+
+/* FNV-1a, to tell whether a screen row changed since the last frame */
+unsigned long long
+editorHashLine(const char *s, int len)
+{
+	unsigned long long h = 14695981039346656037ULL;
+	int j;
+	for (j = 0; j < len; j++)
+	{
+		h ^= (unsigned char)s[j];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+void
+editorDrawLine(struct abuf *ab, int y)
+{
+	int filerow = y + E.rowoff;
+	int from = E.coloff;
+	if (W.enabled)
+	{
+		long long sub;
+		filerow = editorWrapFind(E.lineoff + y, &sub);
+		from = sub * E.screencols;
+	}
+	if (filerow >= E.numrows)
+	{
+		if (E.numrows == 0 && y == E.screenrows / 3)
 		{
-			int len = E.row[filerow].rsize - E.coloff;
-			if (len < 0)
+			char welcome[80];
+			int welcomelen = snprintf(welcome, sizeof(welcome),
+				"Kilo editor -- version %s", KILO_VERSION);
+			if (welcomelen > E.screencols)
 			{
-				len = 0;
+				welcomelen = E.screencols;
 			}
-			if (len > E.screencols)
+			int padding = (E.screencols - welcomelen) / 2;
+			if (padding > 0)
 			{
-				len = E.screencols;
+				abAppend(ab, "~", 1);
+				padding--;
 			}
-			char *c = &E.row[filerow].render[E.coloff];
-			unsigned char *hl = &E.row[filerow].hl[E.coloff];
-			int current_colour = -1;
-			int j;
-			for (j = 0; j < len; j++)
+			while (padding-- > 0)
 			{
-				if (iscntrl(c[j]))
-				{
-					char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-					abAppend(ab, "\x1b[7m", 4);
-					abAppend(ab, &sym, 1);
-					abAppend(ab, "\x1b[m", 3);
-					if (current_colour != -1)
-					{
-						char buf[16];
-						int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_colour);
-						abAppend(ab, buf, clen);
-					}
-				}
-				else if (hl[j] == HL_NORMAL)
-				{
-					if (current_colour != -1)
-					{
-						abAppend(ab, "\x1b[39m", 5);
-						current_colour = -1;
-					}
-					abAppend(ab, &c[j], 1);
-				}
-				else
-				{
-					int colour = editorSyntaxToColour(hl[j]);
-					if (colour != current_colour)
-					{
-						current_colour = colour;
-						char buf[16];
-						int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", colour);
-						abAppend(ab, buf, clen);
-					}
-					abAppend(ab, &c[j], 1);
-				}
+				abAppend(ab, " ", 1);
 			}
-			abAppend(ab, "\x1b[39m", 5);
+			abAppend(ab, welcome, welcomelen);
+		}
+		else
+		{
+			abAppend(ab, "~", 1);
 		}
+	}
+	else
+	{
+		editorDrawRow(ab, &E.row[filerow], from);
+		abAppend(ab, "\x1b[39m", 5);
+	}
+
+	abAppend(ab, "\x1b[K", 3);
+}
+
+/*
+ * Shift what the terminal shows when only the row offset changed, using
+ * a scroll region over the text rows, so that the rows still on screen
+ * need not be sent again.
+ */
+void
+editorScrollLines(struct abuf *ab)
+{
+	long long top = W.enabled ? E.lineoff : E.rowoff;
+	long long n = top - S.top;
+	S.top = top;
+	if (n == 0 || n >= E.screenrows || -n >= E.screenrows)
+	{
+		return;
+	}
+
+	char buf[32];
+	int len = snprintf(buf, sizeof(buf), "\x1b[1;%dr\x1b[%d%c\x1b[r",
+		E.screenrows, (int)((n > 0) ? n : -n), (n > 0) ? 'S' : 'T');
+	abAppend(ab, buf, len);
+
+	int keep = E.screenrows - ((n > 0) ? n : -n);
+	if (n > 0)
+	{
+		memmove(S.lines, &S.lines[n], sizeof(unsigned long long) * keep);
+		memmove(S.valid, &S.valid[n], keep);
+		memset(&S.valid[keep], 0, n);
+	}
+	else
+	{
+		memmove(&S.lines[-n], S.lines, sizeof(unsigned long long) * keep);
+		memmove(&S.valid[-n], S.valid, keep);
+		memset(S.valid, 0, -n);
+	}
+}
 
-		abAppend(ab, "\x1b[K", 3);
-		abAppend(ab, "\r\n", 2);
+/*
+ * Draw the text rows that differ from what the terminal shows. Leaves
+ * the cursor at the start of the status bar.
+ */
+void
+editorDrawRows(struct abuf *ab)
+{
+	if (S.rows != E.screenrows || S.cols != E.screencols)
+	{
+		memFree(MEM_FRAME, S.lines, sizeof(unsigned long long) * S.rows);
+		memFree(MEM_FRAME, S.valid, S.rows);
+		S.rows = E.screenrows;
+		S.cols = E.screencols;
+		S.lines = memAlloc(MEM_FRAME, sizeof(unsigned long long) * S.rows);
+		S.valid = memAlloc(MEM_FRAME, S.rows);
+		memset(S.valid, 0, S.rows);
+		S.top = W.enabled ? E.lineoff : E.rowoff;
+	}
+	editorScrollLines(ab);
+
+	/* row the cursor is at the start of, it starts at the top left */
+	int at = 0;
+	int y;
+	for (y = 0; y < E.screenrows; y++)
+	{
+		struct abuf line = ABUF_INIT;
+		editorDrawLine(&line, y);
+		unsigned long long h = editorHashLine(line.b, line.len);
+		if (!S.valid[y] || S.lines[y] != h)
+		{
+			if (at != y)
+			{
+				char buf[16];
+				int len = snprintf(buf, sizeof(buf), "\x1b[%d;1H", y + 1);
+				abAppend(ab, buf, len);
+			}
+			abAppend(ab, line.b, line.len);
+			abAppend(ab, "\r\n", 2);
+			at = y + 1;
+			S.lines[y] = h;
+			S.valid[y] = 1;
+		}
+		abFree(&line);
+	}
+	if (at != E.screenrows)
+	{
+		char buf[16];
+		int len = snprintf(buf, sizeof(buf), "\x1b[%d;1H", E.screenrows + 1);
+		abAppend(ab, buf, len);
 	}
 }
 
@@ -1488,9 +7117,42 @@ editorDrawStatusBar(struct abuf *ab)
 		E.filename ? E.filename : "[No Name]",
 		E.numrows,
 		E.dirty != 0 ? "(modified)" : "");
-	int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
-		E.syntax ? E.syntax->filetype : "no ft",
-		E.cy + 1, E.numrows);
+	if (D.active)
+	{
+		char bytes[16];
+		memFormat(bytes, sizeof(bytes), D.total);
+		len = snprintf(status, sizeof(status), "%.20s - %d lines, %sB read...",
+			E.filename ? E.filename : "[stdin]", E.numrows, bytes);
+	}
+	/* the pager does not know which line of the file it is on */
+	char where[32];
+	if (V.active)
+	{
+		len = snprintf(status, sizeof(status), "%.20s - read-only",
+			E.filename);
+		long long offset = V.offsets[(E.cy < E.numrows) ? E.cy : E.numrows];
+		snprintf(where, sizeof(where), "%lld%%",
+			(V.size > 0) ? offset * 100 / V.size : 100);
+	}
+	else
+	{
+		snprintf(where, sizeof(where), "%d/%d", E.cy + 1, E.numrows);
+	}
+	int rlen;
+	if (P.overlay)
+	{
+		char last[24];
+		char p99[24];
+		perfFormat(last, sizeof(last), P.last[PERF_FRAME]);
+		perfFormat(p99, sizeof(p99), histPercentile(&P.hist[PERF_FRAME], 0.99));
+		rlen = snprintf(rstatus, sizeof(rstatus), "%s p99 %s %lldB | %s",
+			last, p99, P.last[PERF_BYTES], where);
+	}
+	else
+	{
+		rlen = snprintf(rstatus, sizeof(rstatus), "%s | %s",
+			E.syntax ? E.syntax->filetype : "no ft", where);
+	}
 	if (len > E.screencols)
 	{
 		len = E.screencols;
@@ -1533,10 +7195,15 @@ editorDrawMessageBar(struct abuf *ab)
 void
 editorRefreshScreen(void)
 {
+	traceBegin("editorRefreshScreen");
+	long long start = editorNow();
 	editorScroll();
+	long long scrolled = editorNow();
 
 	struct abuf ab = ABUF_INIT;
 
+	/* begin synchronized update, the terminal shows the frame at once */
+	abAppend(&ab, "\x1b[?2026h", 8);
 	/* hide cursor */
 	abAppend(&ab, "\x1b[?25l", 6);
 	/* move cursor to top left */
@@ -1545,21 +7212,45 @@ editorRefreshScreen(void)
 	editorDrawStatusBar(&ab);
 	editorDrawMessageBar(&ab);
 
+	int y = E.cy - E.rowoff;
+	int x = E.rx - E.coloff;
+	if (W.enabled)
+	{
+		y = editorWrapCursor() - E.lineoff;
+		x = E.rx % E.screencols;
+	}
 	char buf[32];
-	snprintf(buf, sizeof(buf), "\x1b[%d;%dH",
-		(E.cy - E.rowoff) + 1,
-		(E.rx - E.coloff) + 1);
+	snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
 	abAppend(&ab, buf, strlen(buf));
 
 	/* show cursor */
 	abAppend(&ab, "\x1b[?25h", 6);
+	/* end synchronized update */
+	abAppend(&ab, "\x1b[?2026l", 8);
 
-#ifdef _WIN32
-	WriteConsole(GetStdHandle(STD_OUTPUT_HANDLE), ab.b, ab.len, NULL, NULL);
-#else
-	write(STDOUT_FILENO, ab.b, ab.len);
-#endif
+	long long drawn = editorNow();
+	editorWrite(ab.b, ab.len);
+	editorPerfFrame(scrolled - start, drawn - scrolled, editorNow() - drawn, ab.len);
+	traceEndArg("editorRefreshScreen", "bytes", ab.len);
 	abFree(&ab);
+	S.painted = editorNow();
+}
+
+/*
+ * Paint a frame after handling a key, unless more keys arrive within the
+ * frame interval: those are handled first, so bursts of input are drawn
+ * at most once per interval. The last frame is painted as soon as the
+ * input stops.
+ */
+void
+editorFrame(void)
+{
+	long long wait = S.painted + S.interval - editorNow();
+	if (wait > 0 && editorInputWait(wait))
+	{
+		return;
+	}
+	editorRefreshScreen();
 }
 
 void
@@ -1582,12 +7273,32 @@ initEditor(void)
 	E.rowoff = 0;
 	E.coloff = 0;
 	E.numrows = 0;
+	E.rowcap = 0;
 	E.row = NULL;
+	memset(&E.arena, 0, sizeof(E.arena));
 	E.dirty = 0;
 	E.filename = NULL;
 	E.statusmsg[0] = '\0';
 	E.statusmsg_time = 0;
 	E.syntax = NULL;
+	memset(&E.undo, 0, sizeof(E.undo));
+	E.undo.last = UNDO_NONE;
+	E.undo.dropped = UNDO_NONE;
+	E.undo.limit = KILO_UNDO_LIMIT;
+	editorPerfInit();
+	traceInit();
+	char *esc = getenv("KILO_ESC_TIMEOUT");
+	int esc_ms = (esc != NULL && atoi(esc) >= 0) ? atoi(esc) : KILO_ESC_TIMEOUT;
+	I.esc_timeout = esc_ms * 1000000LL;
+	char *fps = getenv("KILO_FPS");
+	/* zero paints a frame for every key */
+	int rate = (fps != NULL && atoi(fps) >= 0) ? atoi(fps) : KILO_FPS;
+	S.interval = (rate > 0) ? 1000000000LL / rate : 0;
+	char *limit = getenv("KILO_UNDO_LIMIT");
+	if (limit != NULL && atol(limit) > 0)
+	{
+		E.undo.limit = atol(limit);
+	}
 
 	if (getWindowSize(&E.screenrows, &E.screencols) == -1)
 	{
@@ -1598,22 +7309,100 @@ initEditor(void)
 	E.screenrows -= 2;
 }
 
+#ifndef KILO_NO_MAIN
 int
 main(int argc, char *argv[])
 {
-	enableRawMode();
+	int argi = 1;
+	R.record = -1;
+	while (argi + 1 < argc && argv[argi][0] == '-' && argv[argi][1] == '-')
+	{
+		if (strcmp(argv[argi], "--replay") == 0)
+		{
+			editorReplayOpen(argv[argi + 1]);
+		}
+#ifndef _WIN32
+		else if (strcmp(argv[argi], "--record") == 0)
+		{
+			R.record = open(argv[argi + 1], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+			if (R.record == -1)
+			{
+				die("open");
+			}
+		}
+#endif
+		else
+		{
+			break;
+		}
+		argi += 2;
+	}
+#ifndef _WIN32
+	int pager = 0;
+	if (argi < argc && strcmp(argv[argi], "-R") == 0)
+	{
+		pager = 1;
+		argi++;
+	}
+	else if (argi < argc && strcmp(argv[argi], "-F") == 0)
+	{
+		/* follow the end of a growing file */
+		pager = 2;
+		argi++;
+	}
+	/* kilo - reads the file from standard input */
+	if (argc > argi && strcmp(argv[argc - 1], "-") == 0)
+	{
+		if (pager)
+		{
+			fprintf(stderr, "kilo: -R and -F need a file, not standard input\n");
+			exit(1);
+		}
+		editorStreamOpen();
+	}
+#endif
+
+	if (!R.active)
+	{
+		enableRawMode();
+	}
 	initEditor();
-	if (argc >= 2)
+	/* kilo +N file starts at line N */
+	char *target = NULL;
+	if (argc > argi + 1 && argv[argi][0] == '+')
+	{
+		target = &argv[argi][1];
+		argi++;
+	}
+#ifndef _WIN32
+	if (pager == 2 && argc > argi)
+	{
+		editorFollowOpen(argv[argi]);
+	}
+	else if (pager && argc > argi)
+	{
+		editorPagerOpen(argv[argi]);
+	}
+	else
+#endif
+	if (argc > argi && !D.active)
 	{
-		editorOpen(argv[1]);
+		editorOpen(argv[argi]);
 	}
 
-	editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
+	editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find | Ctrl-Z/Y = undo/redo");
+	if (target != NULL && editorGotoTarget(target) == -1)
+	{
+		editorSetStatusMessage("Not a line or offset: %s", target);
+	}
 
+	editorStartThreads();
+	editorRefreshScreen();
 	while (1)
 	{
-		editorRefreshScreen();
 		editorProcessKeypress();
+		editorFrame();
 	}
 	return 0;
 }
+#endif
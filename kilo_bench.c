@@ -0,0 +1,440 @@
+/*
+ * Micro-benchmarks for the editor core. kilo.c is compiled into this file
+ * without its main(), and its kernels are run on generated text without
+ * touching the terminal. Results are printed as tab separated columns,
+ * one line per corpus and kernel, so runs of two builds can be diffed.
+ *
+ * Usage: kilo_bench [corpus ...]
+ * KILO_BENCH_SCALE multiplies the number of generated lines.
+ */
+
+/*** includes ***/
+
+#define _DEFAULT_SOURCE
+#define _BSD_SOURCE
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+/*** allocation counting ***/
+
+/* calls into the allocator made by the editor */
+unsigned long bench_allocs;
+
+void *
+benchMalloc(size_t size)
+{
+	bench_allocs++;
+	return malloc(size);
+}
+
+void *
+benchRealloc(void *p, size_t size)
+{
+	bench_allocs++;
+	return realloc(p, size);
+}
+
+char *
+benchStrdup(const char *s)
+{
+	bench_allocs++;
+	return strdup(s);
+}
+
+#ifndef _WIN32
+void *
+benchMmap(void *addr, size_t len, int prot, int flags, int fd, off_t off)
+{
+	bench_allocs++;
+	return mmap(addr, len, prot, flags, fd, off);
+}
+#define mmap(addr, len, prot, flags, fd, off) benchMmap(addr, len, prot, flags, fd, off)
+#endif
+
+#define malloc(size) benchMalloc(size)
+#define realloc(p, size) benchRealloc(p, size)
+#define strdup(s) benchStrdup(s)
+
+/* the system headers gave it a value, kilo.c defines it again */
+#undef _DEFAULT_SOURCE
+#define KILO_NO_MAIN
+#include "kilo.c"
+
+#undef malloc
+#undef realloc
+#undef strdup
+
+/*** timing ***/
+
+#define BENCH_SCREEN_ROWS 50
+#define BENCH_SCREEN_COLS 200
+/* single character edits timed per corpus */
+#define BENCH_EDITS 20000
+
+uint64_t
+benchNow(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* timings of one kernel on one corpus */
+struct benchRun
+{
+	const char *corpus;
+	const char *kernel;
+	uint64_t *samples;
+	int ops;
+	int cap;
+	uint64_t bytes;
+	uint64_t total;
+	unsigned long allocs;
+	uint64_t start;
+};
+
+void
+benchBegin(struct benchRun *r, const char *corpus, const char *kernel)
+{
+	r->corpus = corpus;
+	r->kernel = kernel;
+	r->ops = 0;
+	r->bytes = 0;
+	r->total = 0;
+	r->allocs = bench_allocs;
+}
+
+void
+benchStart(struct benchRun *r)
+{
+	r->start = benchNow();
+}
+
+/* one operation of the kernel processed `bytes` bytes */
+void
+benchStop(struct benchRun *r, size_t bytes)
+{
+	uint64_t ns = benchNow() - r->start;
+	if (r->ops == r->cap)
+	{
+		r->cap = (r->cap == 0) ? 1024 : r->cap * 2;
+		r->samples = realloc(r->samples, sizeof(uint64_t) * r->cap);
+	}
+	r->samples[r->ops++] = ns;
+	r->total += ns;
+	r->bytes += bytes;
+}
+
+int
+benchCompare(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+void
+benchEnd(struct benchRun *r)
+{
+	unsigned long allocs = bench_allocs - r->allocs;
+	if (r->ops == 0)
+	{
+		return;
+	}
+	qsort(r->samples, r->ops, sizeof(uint64_t), benchCompare);
+	printf("%s\t%s\t%d\t%llu\t%.3f\t%llu\t%llu\t%lu\n",
+		r->corpus, r->kernel, r->ops,
+		(unsigned long long)r->bytes,
+		r->bytes > 0 ? (double)r->total / r->bytes : 0.0,
+		(unsigned long long)r->samples[r->ops / 2],
+		(unsigned long long)r->samples[(int)(r->ops * 0.99)],
+		allocs);
+	fflush(stdout);
+}
+
+/*** corpora ***/
+
+uint32_t bench_seed;
+
+uint32_t
+benchRandom(void)
+{
+	/* xorshift, so every build sees the same text */
+	bench_seed ^= bench_seed << 13;
+	bench_seed ^= bench_seed >> 17;
+	bench_seed ^= bench_seed << 5;
+	return bench_seed;
+}
+
+const char *bench_tokens[] =
+{
+	"int", "x", "=", "42", ";", "return", "(", ")", "{", "}", "if", "while",
+	"buf[i]", "+", "3.14", "\"string\"", "'c'", "->", "char", "*p", ",",
+	"struct", "foo", "NULL", "0x1f", "&&", "||", "break;", "sizeof"
+};
+
+/* append tokens to `line` until it is `len` chars, separated by `sep` */
+int
+benchTokens(char *line, int at, int len, char sep)
+{
+	int ntokens = sizeof(bench_tokens) / sizeof(bench_tokens[0]);
+	while (at < len)
+	{
+		const char *t = bench_tokens[benchRandom() % ntokens];
+		int n = strlen(t);
+		if (at + n + 1 > len)
+		{
+			n = len - at - 1;
+		}
+		memcpy(&line[at], t, n);
+		at += n;
+		if (at < len)
+		{
+			line[at++] = sep;
+		}
+	}
+	return at;
+}
+
+/* C-like code with space indentation */
+int
+benchShortLine(char *line, int filerow)
+{
+	(void)filerow;
+	int indent = 4 * (benchRandom() % 4);
+	memset(line, ' ', indent);
+	return benchTokens(line, indent, indent + 20 + benchRandom() % 60, ' ');
+}
+
+/* rows long enough to be split into chunks */
+int
+benchLongLine(char *line, int filerow)
+{
+	(void)filerow;
+	return benchTokens(line, 0, 20000 + benchRandom() % 80000, ' ');
+}
+
+/* tab indentation and tabs between tokens */
+int
+benchTabLine(char *line, int filerow)
+{
+	(void)filerow;
+	int indent = benchRandom() % 5;
+	memset(line, '\t', indent);
+	return benchTokens(line, indent, indent + 20 + benchRandom() % 100, '\t');
+}
+
+/* block comments spanning rows, line comments and code */
+int
+benchCommentLine(char *line, int filerow)
+{
+	const char *text;
+	switch (filerow % 8)
+	{
+	case 0:
+		text = "/* block comment starts here";
+		break;
+	case 1:
+	case 2:
+		text = " * and continues with \"quotes\" and 'chars' 123";
+		break;
+	case 3:
+		text = " */ int after_comment = 1; // trailing";
+		break;
+	case 4:
+		text = "// line comment with keywords: int while return";
+		break;
+	default:
+		return benchShortLine(line, filerow);
+	}
+	int len = strlen(text);
+	memcpy(line, text, len);
+	return len;
+}
+
+struct benchCorpus
+{
+	const char *name;
+	int lines;
+	int (*generate)(char *line, int filerow);
+};
+
+struct benchCorpus bench_corpora[] =
+{
+	{"short", 200000, benchShortLine},
+	{"long", 100, benchLongLine},
+	{"tabs", 200000, benchTabLine},
+	{"comments", 200000, benchCommentLine},
+	{"huge", 2000000, benchShortLine},
+};
+
+#define BENCH_NCORPORA (int)(sizeof(bench_corpora) / sizeof(bench_corpora[0]))
+
+/*** kernels ***/
+
+void
+benchReset(void)
+{
+	arenaFree(&E.arena);
+	memFree(MEM_ROWS, E.row, sizeof(erow) * E.rowcap);
+	memset(&E, 0, sizeof(E));
+	/* the rows are gone, count each corpus from zero */
+	memset(&M, 0, sizeof(M));
+	E.undo.last = UNDO_NONE;
+	E.undo.limit = KILO_UNDO_LIMIT;
+	/* edits made by the kernels are not worth undoing */
+	E.undo.suspended = 1;
+	E.screenrows = BENCH_SCREEN_ROWS;
+	E.screencols = BENCH_SCREEN_COLS;
+	E.filename = "bench.c";
+	editorSelectSyntaxHighlight();
+}
+
+void
+benchCorpus(struct benchCorpus *c, double scale)
+{
+	struct benchRun r;
+	memset(&r, 0, sizeof(r));
+	int lines = c->lines * scale;
+	if (lines < 1)
+	{
+		lines = 1;
+	}
+	int j;
+
+	benchReset();
+	bench_seed = 2463534242u;
+	char *line = malloc(128 * 1024);
+	benchBegin(&r, c->name, "editorInsertRow");
+	for (j = 0; j < lines; j++)
+	{
+		int len = c->generate(line, j);
+		benchStart(&r);
+		editorInsertRow(E.numrows, line, len);
+		benchStop(&r, len);
+	}
+	benchEnd(&r);
+	free(line);
+
+	benchBegin(&r, c->name, "editorUpdateRow");
+	for (j = 0; j < E.numrows; j++)
+	{
+		benchStart(&r);
+		editorUpdateRow(&E.row[j]);
+		benchStop(&r, E.row[j].size);
+	}
+	benchEnd(&r);
+
+	benchBegin(&r, c->name, "editorUpdateSyntax");
+	for (j = 0; j < E.numrows; j++)
+	{
+		benchStart(&r);
+		editorUpdateSyntax(&E.row[j]);
+		benchStop(&r, E.row[j].size);
+	}
+	benchEnd(&r);
+
+	benchBegin(&r, c->name, "editorRowCxToRx");
+	for (j = 0; j < E.numrows; j++)
+	{
+		benchStart(&r);
+		volatile int rx = editorRowCxToRx(&E.row[j], E.row[j].size);
+		benchStop(&r, E.row[j].size);
+		(void)rx;
+	}
+	benchEnd(&r);
+
+	benchBegin(&r, c->name, "abAppend");
+	struct abuf ab = ABUF_INIT;
+	for (j = 0; j < E.numrows; j++)
+	{
+		editorRowFlatten(&E.row[j]);
+		benchStart(&r);
+		abAppend(&ab, E.row[j].chars, E.row[j].size);
+		benchStop(&r, E.row[j].size);
+	}
+	abFree(&ab);
+	benchEnd(&r);
+
+	benchBegin(&r, c->name, "editorDrawRows");
+	for (E.rowoff = 0; E.rowoff < E.numrows; E.rowoff += E.screenrows)
+	{
+		struct abuf screen = ABUF_INIT;
+		benchStart(&r);
+		editorDrawRows(&screen);
+		benchStop(&r, screen.len);
+		abFree(&screen);
+	}
+	E.rowoff = 0;
+	benchEnd(&r);
+
+	/* type into and delete from the middle of rows spread over the file */
+	int step = (E.numrows > BENCH_EDITS) ? E.numrows / BENCH_EDITS : 1;
+	benchBegin(&r, c->name, "editorRowInsertChar");
+	for (j = 0; j < E.numrows && r.ops < BENCH_EDITS; j += step)
+	{
+		erow *row = &E.row[j];
+		benchStart(&r);
+		editorRowInsertChar(row, row->size / 2, 'x');
+		benchStop(&r, row->size);
+	}
+	benchEnd(&r);
+
+	benchBegin(&r, c->name, "editorRowDelChar");
+	for (j = 0; j < E.numrows && r.ops < BENCH_EDITS; j += step)
+	{
+		erow *row = &E.row[j];
+		benchStart(&r);
+		editorRowDelChar(row, (row->size - 1) / 2);
+		benchStop(&r, row->size);
+	}
+	benchEnd(&r);
+
+	free(r.samples);
+
+	/* memory by subsystem after the kernels, on stderr to keep stdout a table */
+	char prefix[64];
+	snprintf(prefix, sizeof(prefix), "%s\t", c->name);
+	editorMemReport(stderr, prefix);
+}
+
+/*** main ***/
+
+int
+main(int argc, char *argv[])
+{
+	double scale = 1.0;
+	char *s = getenv("KILO_BENCH_SCALE");
+	if (s != NULL && atof(s) > 0)
+	{
+		scale = atof(s);
+	}
+
+	printf("corpus\tkernel\tops\tbytes\tns_per_byte\tp50_ns\tp99_ns\tallocs\n");
+	fprintf(stderr, "corpus\ttag\tlive\tpeak\tcalls\n");
+	int k;
+	for (k = 0; k < BENCH_NCORPORA; k++)
+	{
+		int j;
+		int selected = (argc < 2);
+		for (j = 1; j < argc; j++)
+		{
+			if (strcmp(argv[j], bench_corpora[k].name) == 0)
+			{
+				selected = 1;
+			}
+		}
+		if (selected)
+		{
+			benchCorpus(&bench_corpora[k], scale);
+		}
+	}
+	return 0;
+}